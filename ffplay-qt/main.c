@@ -2,20 +2,46 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <libpostproc/postprocess.h>
 #include <libavutil/fifo.h>
 #include <libavutil/ffversion.h>
 #include <libavutil/time.h>
-#include <libavcodec/avfft.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/macros.h>
 #include <libavutil/avstring.h>
+#include <libavutil/bprint.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/crc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/md5.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/tx.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_thread.h>
 
 #include <signal.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2_VISUALIZER 1
+#else
+#define USE_SSE2_VISUALIZER 0
+#endif
 
 #include "cmdutils.h"
 #include "opt_common.h"
@@ -25,30 +51,248 @@ const int program_birth_year = 2003;
 
 #define SAMPLE_ARRAY_SIZE (8 * 65536)
 
+/* the audio ring holds at least this much, in milliseconds */
+#define AUDIO_RING_MSEC 100
+
 #define CURSOR_HIDE_DELAY 1000000
 
+/* bitmap subtitle rects are converted once into an atlas of this size and reused */
+#define SUB_ATLAS_SIZE 2048
+#define SUB_ATLAS_MAX_ENTRIES 256
+#define SUB_ATLAS_MAX_SHELVES 64
+
 /* polls for possible required screen refresh at least this often, should be less than 1/fps */
 #define REFRESH_RATE 0.01
+/* longest sleep of the refresh loop without a frame deadline, decoders wake it earlier */
+#define REFRESH_MAX_SLEEP 0.5
+/* microseconds between two status lines */
+#define STATUS_INTERVAL 30000
 
+/* default frame queue depths, see -pictq, -subq and -sampq */
 #define VIDEO_PICTURE_QUEUE_SIZE 3
 #define SUBPICTURE_QUEUE_SIZE 16
 #define SAMPLE_QUEUE_SIZE 3
-#define FRAME_QUEUE_SIZE FFMAX(SAMPLE_QUEUE_SIZE, FFMAX(VIDEO_PICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE))
+#define FRAME_QUEUE_MAX_SIZE 1024
+
+/* minimum packets per stream when the demuxer gives no packet durations */
+#define MIN_FRAMES 25
+/* the read-ahead target never drops below this many seconds */
+#define READAHEAD_MIN 0.1
+/* how often the read-ahead target may be grown or shrunk, in microseconds */
+#define READAHEAD_ADJUST_INTERVAL 1000000
+
+/* video packets skipped at most while waiting for a keyframe after a seek,
+ * some streams never flag one */
+#define KEYFRAME_WAIT_MAX 300
+
+/* -predrop: decode plus render time per second of video that makes the
+ * controller skip more, or less, and the decoded frames it waits after a change */
+#define PREDROP_HIGH 0.9
+#define PREDROP_LOW  0.5
+#define PREDROP_HOLD_UP    8
+#define PREDROP_HOLD_DOWN  50
+
+#define EXTERNAL_CLOCK_MIN_FRAMES 2
+#define EXTERNAL_CLOCK_MAX_FRAMES 10
+
+/* Minimum SDL audio buffer size, in samples. */
+#define SDL_AUDIO_MIN_BUFFER_SIZE 512
+/* Calculate actual buffer size keeping in mind not cause too frequent audio callbacks */
+#define SDL_AUDIO_MAX_CALLBACKS_PER_SEC 30
+
+/* no AV sync correction is done if below the minimum AV sync threshold */
+#define AV_SYNC_THRESHOLD_MIN 0.04
+/* AV sync correction is done if above the maximum AV sync threshold */
+#define AV_SYNC_THRESHOLD_MAX 0.1
+/* If a frame duration is longer than this, it will not be duplicated to compensate AV sync */
+#define AV_SYNC_FRAMEDUP_THRESHOLD 0.1
+/* no AV correction is done if too big error */
+#define AV_NOSYNC_THRESHOLD 10.0
+
+/* maximum audio speed change to get correct sync */
+#define SAMPLE_CORRECTION_PERCENT_MAX 10
+
+/* external clock speed adjustment constants for realtime sources based on buffer fullness */
+#define EXTERNAL_CLOCK_SPEED_MIN  0.900
+#define EXTERNAL_CLOCK_SPEED_MAX  1.010
+#define EXTERNAL_CLOCK_SPEED_STEP 0.001
+
+/* -lowlatency: playback speed range, and the speed change per second of
+ * latency above the target */
+#define LOWLATENCY_SPEED_MIN 0.98
+#define LOWLATENCY_SPEED_MAX 1.05
+#define LOWLATENCY_GAIN      0.1
+#define LOWLATENCY_MAX_ERROR 60.0   /* larger differences are timestamp jumps, not latency */
+
+/* we use about AUDIO_DIFF_AVG_NB A-V differences to make the average */
+#define AUDIO_DIFF_AVG_NB   20
+
+/* upper bound for automatically chosen decoder threads, as in libavcodec */
+#define MAX_AUTO_THREADS 16
+
+/* Step size for volume control in dB */
+#define SDL_VOLUME_STEP (0.75)
+
+#define WAIT_HIST_BUCKETS 32
+
+enum {
+    VCLOCK_OFF,     /* wall clock */
+    VCLOCK_FAST,    /* virtual, jumps straight to the next frame deadline */
+    VCLOCK_STEP,    /* virtual, moves by a fixed step per refresh */
+};
+
+/* packets moved per lock by the batched packet queue calls */
+#define PACKET_BATCH_SIZE 8
+
+/* log2 histogram of wait times in microseconds, updated without locks.
+ * Bucket 0 counts waits under 1us, bucket i those in [2^(i-1), 2^i). */
+typedef struct WaitHistogram {
+    SDL_atomic_t max;
+    SDL_atomic_t buckets[WAIT_HIST_BUCKETS];
+} WaitHistogram;
+
+#define STARTUP_TRACE_MAX 32
+
+typedef struct StartupMark {
+    const char *what;       /* set last, a NULL entry is still being written */
+    int64_t time;
+} StartupMark;
+
+#define MAPPED_IO_BUFFER_SIZE (64 * 1024)
+/* how far ahead of the read position -io mmap asks the kernel to page in */
+#define MAPPED_IO_READAHEAD (16 << 20)
+
+/* a local file read through a memory mapping, see -io mmap */
+typedef struct MappedFile {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+    int64_t advised;        /* end of the range last passed to madvise(MADV_WILLNEED) */
+    long page_size;
+} MappedFile;
+
+#define KFIDX_MAGIC "FFKFIDX1"
+#define KFIDX_SUFFIX ".kfidx"
+/* keyframes closer than this to the previous entry are left out of the index */
+#define KFIDX_MIN_SPACING (AV_TIME_BASE / 4)
+
+/* On-disk keyframe index next to the media file: this header followed by
+ * nb_entries KeyframeIndexEntry sorted by both pts and pos. */
+typedef struct KeyframeIndexHeader {
+    char magic[8];
+    int64_t file_size;      /* of the indexed file, any change invalidates the index */
+    int64_t file_mtime;
+    int64_t nb_entries;
+} KeyframeIndexHeader;
+
+typedef struct KeyframeIndexEntry {
+    int64_t pts;            /* in AV_TIME_BASE units */
+    int64_t pos;            /* byte offset of the keyframe packet */
+} KeyframeIndexEntry;
+
+typedef struct KeyframeIndex {
+    void *map;
+    size_t map_size;
+    const KeyframeIndexEntry *entries;
+    int nb_entries;
+} KeyframeIndex;
+
+#define PROBE_CACHE_MAGIC "FFPROBE1"
+/* bytes at the start of the file that are hashed into the probe cache key */
+#define PROBE_CACHE_HEAD_SIZE 65536
+#define PROBE_CACHE_MAX_EXTRADATA (16 << 20)
+
+/* Probe cache file: this header, path_size bytes of path, then nb_streams
+ * ProbeCacheStream each followed by its extradata. */
+typedef struct ProbeCacheHeader {
+    char magic[8];
+    uint32_t lavf_version;  /* enum values are only stable within a library version */
+    uint32_t lavc_version;
+    int64_t file_size;
+    int64_t file_mtime;
+    uint32_t head_crc;      /* CRC of the first PROBE_CACHE_HEAD_SIZE bytes of the file */
+    int32_t path_size;
+    int32_t nb_streams;
+    int64_t start_time;
+    int64_t duration;
+    int64_t bit_rate;
+} ProbeCacheHeader;
+
+/* what avformat_find_stream_info() fills in for one stream */
+typedef struct ProbeCacheStream {
+    int32_t id;
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t extradata_size;
+    int32_t format;
+    int64_t bit_rate;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    AVRational sample_aspect_ratio;
+    int32_t field_order;
+    int32_t color_range;
+    int32_t color_primaries;
+    int32_t color_trc;
+    int32_t color_space;
+    int32_t chroma_location;
+    int32_t video_delay;
+    int32_t ch_order;
+    int32_t nb_channels;
+    uint64_t ch_mask;
+    int32_t sample_rate;
+    int32_t block_align;
+    int32_t frame_size;
+    int32_t initial_padding;
+    int32_t trailing_padding;
+    int32_t seek_preroll;
+    AVRational time_base;
+    AVRational avg_frame_rate;
+    AVRational r_frame_rate;
+    AVRational stream_sample_aspect_ratio;
+    int64_t start_time;
+    int64_t duration;
+    int64_t nb_frames;
+    int32_t disposition;
+} ProbeCacheStream;
 
 typedef struct MyAVPacketList {
     AVPacket *pkt;
     int serial;
 } MyAVPacketList;
 
+/* recycled AVPacket shells, protected by the owning PacketQueue mutex */
+typedef struct PacketPool {
+    AVPacket **pkts;
+    int nb_pkts;
+    int max_pkts;   /* high-water mark, shells beyond it are freed */
+    int64_t hits;
+    int64_t misses;
+} PacketPool;
+
 typedef struct PacketQueue {
     AVFifo *pkt_list;
+    PacketPool pool;
     int nb_packets;
     int size;
     int64_t duration;
     int abort_request;
     int serial;
+    int nb_underruns;           /* times a blocking get found the queue empty */
+    WaitHistogram get_wait;     /* time packet_queue_get() spent blocked */
+    int64_t refill_duration;    /* wake the reader below this duration, in stream time base */
+    SDL_mutex *refill_mutex;
+    SDL_cond *refill_cond;
     SDL_mutex *mutex;
     SDL_cond *cond;
+    /* producer side only: packets staged for the next packet_queue_put_batch() */
+    AVPacket *staged[PACKET_BATCH_SIZE];
+    int nb_staged;
+    int staged_serial;          /* queue serial when the first staged packet came in */
 } PacketQueue;
 
 typedef struct Frame {
@@ -64,16 +308,48 @@ typedef struct Frame {
     AVRational sar;
     int uploaded;
     int flip_v;
+    SDL_Rect *sub_src;          /* place of each subtitle rect in the atlas */
+    int sub_atlas_generation;   /* sub_src is stale once the atlas was reset */
+    int64_t scale_id;           /* ScaleJob picture filling frame, 0 if none */
+    int64_t mem;                /* bytes counted against -max_mem while queued */
 } Frame;
 
+typedef struct SubAtlasEntry {
+    uint32_t crc;               /* of the PAL8 pixels and the palette */
+    int w, h;
+    SDL_Rect rect;
+} SubAtlasEntry;
+
+typedef struct SubAtlasShelf {
+    int y, h;
+    int x;                      /* first free column */
+} SubAtlasShelf;
+
+/* Shelf packed cache of converted subtitle rects, kept in sub_texture. It
+ * is only ever reset as a whole, when it runs out of room or entries. */
+typedef struct SubAtlas {
+    int w, h;
+    SubAtlasShelf shelves[SUB_ATLAS_MAX_SHELVES];
+    int nb_shelves;
+    int used_h;
+    SubAtlasEntry entries[SUB_ATLAS_MAX_ENTRIES];
+    int nb_entries;
+    int generation;
+    int64_t hits, misses;
+} SubAtlas;
+
 typedef struct FrameQueue {
-    Frame queue[FRAME_QUEUE_SIZE];
+    Frame *queue;
     int rindex;
     int windex;
-    int size;
+    SDL_atomic_t size;
     int max_size;
     int keep_last;
     int rindex_shown;
+    int lockless;           /* single producer/consumer, mutex only taken to block */
+    SDL_atomic_t waiters;   /* sides currently blocked on cond in lockless mode */
+    WaitHistogram write_wait;
+    WaitHistogram read_wait;
     SDL_mutex *mutex;
     SDL_cond *cond;
     PacketQueue *pktq;
@@ -85,6 +361,113 @@ enum {
     AV_SYNC_EXTERNAL_CLOCK,
 };
 
+/* per decoder counters, reported by -bench */
+typedef struct DecoderStats {
+    int64_t nb_packets;
+    int64_t nb_bytes;
+    int64_t nb_frames;
+    int64_t busy;               /* time spent in the codec since the last frame, in microseconds */
+    int64_t last_busy;          /* busy time of the last frame */
+    int64_t *frame_times;       /* busy time of every decoded frame, only kept with -bench */
+    unsigned nb_frame_times;
+    unsigned frame_times_size;
+} DecoderStats;
+
+/* PCM between the audio mixer thread (single producer) and the SDL audio
+ * callback (single consumer). The positions only grow and are masked into
+ * data, neither side ever takes a lock. */
+typedef struct AudioRing {
+    uint8_t *data;
+    int size;                   /* power of two */
+    SDL_atomic_t write_pos;     /* only moved by the mixer */
+    SDL_atomic_t read_pos;      /* only moved by the callback */
+    SDL_atomic_t skip_pos;      /* data before this is stale, the callback jumps over it */
+    /* audio clock at clock_pos, published by the mixer under a sequence count */
+    SDL_atomic_t clock_seq;
+    double clock;
+    int clock_serial;
+    int clock_pos;
+    uint8_t *scratch;           /* callback side, for volume scaling */
+    int scratch_size;
+    SDL_sem *space;             /* posted by the callback once it freed some room */
+} AudioRing;
+
+/* Worker threads shared by all players, converting pictures the renderer
+ * cannot take. Each player owns a ScaleJob: the video thread submits a
+ * picture to it and goes on decoding, the workers convert it one horizontal
+ * band per slice with a context of its own, and the display waits for the
+ * picture only when it uploads the result. A player has one picture in
+ * flight at a time; the pool queues the jobs of all players in order. */
+#define SCALE_MIN_SLICE_H 64
+typedef struct ScaleSlice {
+    struct SwsContext *ctx;
+    int width, height, src_format, dst_format;  /* ctx was created for */
+    int colorspace, src_range, dst_range;       /* last set on ctx */
+} ScaleSlice;
+
+typedef struct ScaleJob {
+    ScaleSlice slices[MAX_AUTO_THREADS];
+    AVFrame *src;               /* the picture, references held by the pool */
+    AVFrame *dst;
+    int slice_h;
+    int nb_slices;
+    int next_slice;             /* first slice no worker took yet */
+    int slices_left;
+    int64_t id;                 /* last picture submitted */
+    int64_t done;               /* last picture finished */
+    struct ScaleJob *next;      /* in the pool queue */
+} ScaleJob;
+
+typedef struct ScalePool {
+    SDL_Thread *threads[MAX_AUTO_THREADS];
+    int nb_threads;             /* started on the first submitted picture */
+    ScaleJob *first_job, *last_job;     /* jobs with slices no worker took yet */
+    int abort;
+    SDL_mutex *mutex;
+    SDL_cond *work_cond;
+    SDL_cond *done_cond;
+} ScalePool;
+
+/* Configured video filter graphs of the video thread, reused when the
+ * filter, size, format and aspect ratio of the input come back. */
+#define VFILTER_CACHE_SIZE 4
+typedef struct VideoFilterCacheEntry {
+    AVFilterGraph *graph;       /* NULL for a free slot */
+    AVFilterContext *in, *out;
+    const char *vfilters;
+    int width, height;
+    int format;
+    AVRational sar;
+    int64_t last_used;
+} VideoFilterCacheEntry;
+
+/* -thumbs: scrub previews decoded from keyframes by a second demuxer and
+ * decoder on a low priority thread. The duration is cut into THUMB_SLOTS
+ * positions, the most recently shown THUMB_CACHE_SIZE of them are kept. */
+#define THUMB_SLOTS 256
+#define THUMB_CACHE_SIZE 64
+#define THUMB_WIDTH 160
+#define THUMB_LOWRES 2
+#define THUMB_MAX_PACKETS 256   /* give up on a position after this many video packets */
+#define THUMB_BAR_HEIGHT 48     /* pixels at the bottom of the video showing previews */
+typedef struct Thumbnail {
+    int slot;                   /* -1 for a free entry */
+    int width, height;
+    uint8_t *pixels;            /* BGRA */
+    int64_t last_used;
+} Thumbnail;
+
+typedef struct ThumbEngine {
+    SDL_Thread *tid;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    Thumbnail thumbs[THUMB_CACHE_SIZE];
+    int64_t uses;
+    uint8_t failed[THUMB_SLOTS];
+    int want_slot;              /* asked for by the display, -1 if none */
+    int nb_prefetched;          /* positions of the prefetch order tried so far */
+} ThumbEngine;
+
 typedef struct Decoder {
     AVPacket *pkt;
     PacketQueue *queue;
@@ -98,6 +481,14 @@ typedef struct Decoder {
     int64_t next_pts;
     AVRational next_pts_tb;
     SDL_Thread *decoder_tid;
+    DecoderStats stats;
+    int batch_size;                         /* packets taken per queue lock, 1 takes them one by one */
+    AVPacket *batch[PACKET_BATCH_SIZE];     /* taken from the queue, not yet sent to the codec */
+    int batch_serial[PACKET_BATCH_SIZE];
+    int nb_batch;
+    int batch_index;
+    int keyframe_wait;                      /* packets still allowed to be skipped before a keyframe */
+    int keyframe_skipped;
 } Decoder;
 
 typedef struct Clock {
@@ -130,6 +521,17 @@ typedef struct VideoState {
     int seek_flags;
     int64_t seek_pos;
     int64_t seek_rel;
+    KeyframeIndex *kf_index;        /* set once a matching sidecar is mapped, read by the read thread */
+    SDL_Thread *index_tid;
+    ThumbEngine *thumbs;            /* set by the read thread with -thumbs */
+    double thumb_hover;             /* position under the mouse in the preview bar, NAN if none */
+    SDL_Texture *thumb_texture;
+    int thumb_shown_slot;
+    MappedFile *mapped_file;        /* with -io mmap, backs mapped_pb */
+    AVIOContext *mapped_pb;
+    SDL_atomic_t audio_pending;     /* audio stream being opened by audio_open_thread, -1 if none */
+    SDL_Thread *audio_open_tid;
+    SDL_atomic_t subtitle_pending;  /* subtitle stream opened on its first packet, -1 if none, -2 while opening */
     int read_pause_return;
     AVFormatContext *ic;
     int realtime;
@@ -165,6 +567,17 @@ typedef struct VideoState {
     unsigned int audio_buf1_size;
     int audio_buf_index; /* in bytes */
     int audio_write_buf_size;
+    int64_t vclock_audio_start;     /* -vclock: virtual time the audio output started at */
+    int64_t vclock_audio_bytes;     /* -vclock: bytes handed to the virtual audio output since then */
+    uint8_t *vclock_audio_buf;
+    unsigned int vclock_audio_buf_size;
+    WaitHistogram audio_callback;   /* time spent inside the SDL audio callback */
+    SDL_atomic_t audio_silence;     /* callbacks that had no decoded audio to play */
+    SDL_atomic_t audio_underruns;   /* callbacks the ring could not fill while the decoder was still running */
+    AudioRing audio_ring;           /* only with an audio device, see audio_mixer_thread() */
+    SDL_Thread *audio_mixer_tid;
+    SDL_atomic_t audio_mixer_abort;
+    SDL_atomic_t refresh_waiting;   /* refresh loop sleeps without a deadline, see refresh_loop_wake() */
     int audio_volume;
     int muted;
     struct AudioParams audio_src;
@@ -173,6 +586,12 @@ typedef struct VideoState {
     struct SwrContext *swr_ctx;
     int frame_drops_early;
     int frame_drops_late;
+    enum AVDiscard skip_frame_base; /* skip_frame the user asked for, -predrop only adds to it */
+    int predrop_level;
+    int predrop_hold;
+    double predrop_load;            /* decode and render time per second of video, averaged */
+    double predrop_last_pts;
+    double render_cost;             /* seconds to upload and draw a picture, averaged, set by the display */
 
     enum ShowMode {
         SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
@@ -180,13 +599,20 @@ typedef struct VideoState {
     int16_t sample_array[SAMPLE_ARRAY_SIZE];
     int sample_array_index;
     int last_i_start;
-    RDFTContext *rdft;
+    AVTXContext *rdft;
+    av_tx_fn rdft_fn;
     int rdft_bits;
-    FFTSample *rdft_data;
+    float *real_data;
+    AVComplexFloat *rdft_data;
+    float *rdft_window;             /* Welch window matching rdft_bits */
+    uint32_t *vis_column;           /* spectrum column being drawn at xpos */
+    SDL_Rect *vis_rects;            /* waves display, one rect per sample */
+    unsigned int vis_rects_size;
     int xpos;
     double last_vis_time;
     SDL_Texture *vis_texture;
-    SDL_Texture *sub_texture;
+    SDL_Texture *sub_texture;       /* holds sub_atlas */
+    SubAtlas sub_atlas;
     SDL_Texture *vid_texture;
 
     int subtitle_stream;
@@ -196,16 +622,21 @@ typedef struct VideoState {
     double frame_timer;
     double frame_last_returned_time;
     double frame_last_filter_delay;
+    double live_pts;                /* newest audio or video timestamp read, for -lowlatency */
+    double latency;                 /* live_pts ahead of the external clock, smoothed */
     int video_stream;
     AVStream *video_st;
     PacketQueue videoq;
     double max_frame_duration;
+    struct SwsContext *img_convert_ctx;
     struct SwsContext *sub_convert_ctx;
+    ScaleJob *scale_job;            /* created by the video thread on the first picture to convert */
     int eof;
 
     char* filename;
     int width, height, xleft, ytop;
     int step;
+    int audio_disable;              /* with -mosaic only the first input plays audio */
 
     int vfilter_idx;
     AVFilterContext *in_video_filter;
@@ -216,6 +647,11 @@ typedef struct VideoState {
 
     int last_video_stream, last_audio_stream, last_subtitle_stream;
 
+    double readahead_target;        /* seconds of media to keep queued per stream */
+    int64_t readahead_last_adjust;
+    int readahead_underruns;        /* queue underruns seen at the last adjustment */
+
+    SDL_mutex *continue_read_mutex;
     SDL_cond *continue_read_thread;
 } VideoState;
 
@@ -252,6 +688,7 @@ static int exit_on_keydown;
 static int exit_on_mousedown;
 static int loop = 1;
 static int framedrop = -1;
+static int predrop = 1;
 static int infinite_buffer = -1;
 static enum ShowMode show_mode = SHOW_MODE_NONE;
 static const char *audio_codec_name;
@@ -266,12 +703,64 @@ static char *afilters = NULL;
 static int autorotate = 1;
 static int find_stream_info = 1;
 static int filter_nbthreads = 0;
+static int packet_pool_size = 256;
+static int frame_queue_lockless = 0;
+static float readahead_duration = 1.0;
+static float readahead_max_duration = 30.0;
+static int readahead_max_mem = 64;
+static int pictq_size = VIDEO_PICTURE_QUEUE_SIZE;
+static int subq_size = SUBPICTURE_QUEUE_SIZE;
+static int sampq_size = SAMPLE_QUEUE_SIZE;
+static int64_t max_mem;             /* -max_mem, 0 for no limit */
+static int64_t queued_mem;          /* queued packet and decoded frame bytes of all players */
+static SDL_SpinLock queued_mem_lock;
+static int bench;
+static int keyframe_index;
+static int build_index;
+static const char *probe_cache_dir;
+static int io_mmap;
+static int thumbs_enable;
+static int thumbs_cpu = 10;
+static double lowlatency;           /* -lowlatency target in seconds, 0 when off */
+static int vclock_mode;             /* VCLOCK_*, playback time source */
+static int64_t vclock_step;         /* microseconds per refresh with VCLOCK_STEP */
+static int64_t vclock_now = AV_TIME_BASE;
+static SDL_SpinLock vclock_lock;
+static int startup_trace;
+static int64_t startup_time;
+static StartupMark startup_marks[STARTUP_TRACE_MAX];
+static SDL_atomic_t nb_startup_marks;
+static SDL_atomic_t startup_reported;
+/* decoding may start before main() has created the renderer, see wait_display_ready() */
+static SDL_mutex *display_mutex;
+static SDL_cond *display_cond;
+static int display_ready;
+static ScalePool *scale_pool;
+static const char *wait_stats_file;
+static unsigned sws_flags = SWS_BICUBIC;
+static int video_threads = -1;      /* -1 picks a count from the core budget, 0 leaves it to libavcodec */
+static int audio_threads = -1;
+static int scale_threads = -1;      /* -1 picks a count from the core budget, 0 converts in the filter graph */
+static int decoder_thread_type;     /* FF_THREAD_* mask, 0 keeps the codec default */
+static int host_players = 1;
+static SDL_atomic_t nb_players;     /* open VideoStates sharing the cores of this process */
+
+/* every open VideoState, in input order; with -mosaic they share the window */
+#define MAX_INPUTS 64
+static const char *input_filenames[MAX_INPUTS];
+static int nb_input_filenames;
+static int mosaic;
+static VideoState *videostates[MAX_INPUTS];
+static int nb_videostates;
+static int mosaic_dirty;            /* a viewport changed, redraw and present them all */
 
 /* current context */
 static int is_full_screen;
 static int64_t audio_callback_time;
+static int64_t status_last_time;   /* when the last status line was printed */
 
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
+#define FF_REFRESH_EVENT (SDL_USEREVENT + 3)
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_RendererInfo renderer_info = {0};
@@ -300,6 +789,11 @@ static const struct TextureFormatEntry {
     { AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
     { AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
     { AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+    /* semi-planar, uploaded plane by plane with SDL_UpdateNVTexture() */
+    { AV_PIX_FMT_NV12,           SDL_PIXELFORMAT_NV12 },
+    { AV_PIX_FMT_NV21,           SDL_PIXELFORMAT_NV21 },
+#endif
     { AV_PIX_FMT_NONE,           SDL_PIXELFORMAT_UNKNOWN },
     };
 
@@ -447,16 +941,22 @@ static int opt_show_mode(void *optctx, const char *opt, const char *arg)
 
 static void opt_input_file(void *optctx, const char *filename)
 {
-    if (input_filename) {
+    if (input_filename && !mosaic) {
         av_log(NULL, AV_LOG_FATAL,
                "Argument '%s' provided as input filename, but '%s' was already specified.\n",
                filename, input_filename);
         exit(1);
     }
+    if (nb_input_filenames == MAX_INPUTS) {
+        av_log(NULL, AV_LOG_FATAL, "At most %d inputs can be played in a mosaic\n", MAX_INPUTS);
+        exit(1);
+    }
     if (!strcmp(filename, "-")) {
         filename = "fd:";
     }
-    input_filename = filename;
+    if (!input_filename)
+        input_filename = filename;
+    input_filenames[nb_input_filenames++] = filename;
 }
 
 static int opt_codec(void *optctx, const char *opt, const char *arg)
@@ -487,6 +987,77 @@ static int opt_codec(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+static int opt_decoder_threads(void *optctx, const char *opt, const char *arg)
+{
+    int *threads = !strcmp(opt, "athreads") ? &audio_threads : &video_threads;
+
+    if (!strcmp(arg, "auto"))
+        *threads = -1;
+    else
+        *threads = parse_number_or_die(opt, arg, OPT_INT, 0, MAX_AUTO_THREADS * 4);
+    return 0;
+}
+
+static int opt_thread_type(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "frame"))
+        decoder_thread_type = FF_THREAD_FRAME;
+    else if (!strcmp(arg, "slice"))
+        decoder_thread_type = FF_THREAD_SLICE;
+    else if (!strcmp(arg, "frame+slice"))
+        decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown thread type '%s' (frame, slice or frame+slice)\n", arg);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+static int opt_io(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "mmap"))
+        io_mmap = 1;
+    else if (!strcmp(arg, "read"))
+        io_mmap = 0;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown I/O mode '%s' (mmap or read)\n", arg);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+static int opt_lowlatency(void *optctx, const char *opt, const char *arg)
+{
+    lowlatency = parse_number_or_die(opt, arg, OPT_DOUBLE, 10, 60000) / 1000;
+    return 0;
+}
+
+static int opt_vclock(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "off"))
+        vclock_mode = VCLOCK_OFF;
+    else if (!strcmp(arg, "fast"))
+        vclock_mode = VCLOCK_FAST;
+    else {
+        vclock_step = parse_number_or_die(opt, arg, OPT_DOUBLE, 0.1, 1000) * 1000;
+        vclock_mode = VCLOCK_STEP;
+    }
+    return 0;
+}
+
+static int opt_frame_queue(void *optctx, const char *opt, const char *arg)
+{
+    int size = parse_number_or_die(opt, arg, OPT_INT, 2, FRAME_QUEUE_MAX_SIZE);
+
+    if (!strcmp(opt, "pictq"))
+        pictq_size = size;
+    else if (!strcmp(opt, "subq"))
+        subq_size = size;
+    else
+        sampq_size = size;
+    return 0;
+}
+
 static int dummy;
 
 static const OptionDef options[] = {
@@ -520,6 +1091,7 @@ static const OptionDef options[] = {
     { "exitonmousedown", OPT_BOOL | OPT_EXPERT, { &exit_on_mousedown }, "exit on mouse down", "" },
     { "loop", OPT_INT | HAS_ARG | OPT_EXPERT, { &loop }, "set number of times the playback shall be looped", "loop count" },
     { "framedrop", OPT_BOOL | OPT_EXPERT, { &framedrop }, "drop frames when cpu is too slow", "" },
+    { "predrop", OPT_BOOL | OPT_EXPERT, { &predrop }, "with framedrop, skip decoding non-reference frames when the measured load predicts late frames", "" },
     { "infbuf", OPT_BOOL | OPT_EXPERT, { &infinite_buffer }, "don't limit the input buffer size (useful with realtime streams)", "" },
     { "window_title", OPT_STRING | HAS_ARG, { &window_title }, "set window title", "window title" },
     { "left", OPT_INT | HAS_ARG | OPT_EXPERT, { &screen_left }, "set the x position for the left of the window", "x pos" },
@@ -539,6 +1111,32 @@ static const OptionDef options[] = {
         "read and decode the streams to fill missing information with heuristics"
     },
     { "filter_threads", HAS_ARG | OPT_INT | OPT_EXPERT, { &filter_nbthreads }, "number of filter threads per graph" },
+    { "pkt_pool", HAS_ARG | OPT_INT | OPT_EXPERT, { &packet_pool_size }, "max number of recycled packets kept per packet queue", "count" },
+    { "fq_lockless", OPT_BOOL | OPT_EXPERT, { &frame_queue_lockless }, "use lock-free single producer/consumer frame queues", "" },
+    { "readahead", OPT_FLOAT | HAS_ARG | OPT_EXPERT, { &readahead_duration }, "initial duration of media to buffer per stream", "seconds" },
+    { "readahead_max", OPT_FLOAT | HAS_ARG | OPT_EXPERT, { &readahead_max_duration }, "upper bound for the adaptive read-ahead duration", "seconds" },
+    { "readahead_mem", OPT_INT | HAS_ARG | OPT_EXPERT, { &readahead_max_mem }, "shrink the read-ahead when queued packets exceed this many megabytes", "MB" },
+    { "max_mem", OPT_INT64 | HAS_ARG | OPT_EXPERT, { &max_mem }, "cap memory held by queued packets and decoded frames", "bytes" },
+    { "scale_threads", OPT_INT | HAS_ARG | OPT_EXPERT, { &scale_threads }, "threads converting pictures the renderer cannot display, 0 converts them in the filter graph (default: from the core count)", "count" },
+    { "thumbs", OPT_BOOL | OPT_EXPERT, { &thumbs_enable }, "show keyframe previews when the mouse hovers over the bottom of the video" },
+    { "thumbs_cpu", OPT_INT | HAS_ARG | OPT_EXPERT, { &thumbs_cpu }, "share of one core the preview decoder may use", "percent" },
+    { "lowlatency", HAS_ARG | OPT_EXPERT, { .func_arg = opt_lowlatency }, "probe and buffer little, and on realtime inputs play faster to hold this latency", "ms" },
+    { "pictq", HAS_ARG | OPT_EXPERT, { .func_arg = opt_frame_queue }, "number of decoded pictures to queue", "count" },
+    { "subq", HAS_ARG | OPT_EXPERT, { .func_arg = opt_frame_queue }, "number of decoded subtitles to queue", "count" },
+    { "sampq", HAS_ARG | OPT_EXPERT, { .func_arg = opt_frame_queue }, "number of decoded audio frames to queue", "count" },
+    { "bench", OPT_BOOL | OPT_EXPERT, { &bench }, "decode as fast as possible without display or audio output and report the throughput", "" },
+    { "wait_stats", OPT_STRING | HAS_ARG | OPT_EXPERT, { &wait_stats_file }, "write queue wait histograms as JSON to file at exit and on 'i' ('-' for stdout)", "file" },
+    { "vthreads", HAS_ARG | OPT_EXPERT, { .func_arg = opt_decoder_threads }, "number of video decoding threads, 0 lets the decoder decide", "auto|count" },
+    { "athreads", HAS_ARG | OPT_EXPERT, { .func_arg = opt_decoder_threads }, "number of audio decoding threads, 0 lets the decoder decide", "auto|count" },
+    { "thread_type", HAS_ARG | OPT_EXPERT, { .func_arg = opt_thread_type }, "decoder threading method", "frame|slice|frame+slice" },
+    { "host_players", OPT_INT | HAS_ARG | OPT_EXPERT, { &host_players }, "number of players sharing the CPU cores, used by automatic threading", "count" },
+    { "kfindex", OPT_BOOL | OPT_EXPERT, { &keyframe_index }, "seek through a keyframe index kept next to local files, building it in the background when missing", "" },
+    { "build_index", OPT_BOOL | OPT_EXPERT, { &build_index }, "write the keyframe index of the input file and exit", "" },
+    { "probe_cache", OPT_STRING | HAS_ARG | OPT_EXPERT, { &probe_cache_dir }, "keep the stream parameters found by probing local files in this directory and skip probing on the next open", "dir" },
+    { "startup_trace", OPT_BOOL | OPT_EXPERT, { &startup_trace }, "report where the time went until the first frame was presented", "" },
+    { "mosaic", OPT_BOOL | OPT_EXPERT, { &mosaic }, "play all following inputs in one window, each in its own viewport (audio from the first)" },
+    { "vclock", HAS_ARG | OPT_EXPERT, { .func_arg = opt_vclock }, "run playback on a virtual clock: fast, a step in milliseconds, or off", "mode" },
+    { "io", HAS_ARG | OPT_EXPERT, { .func_arg = opt_io }, "read local files through a memory mapping or with plain reads", "mmap|read" },
     { NULL, },
 };
 
@@ -572,6 +1170,7 @@ void show_help_default(const char *opt, const char *arg)
            "c                   cycle program\n"
            "w                   cycle video filters or show modes\n"
            "s                   activate frame-step mode\n"
+           "i                   dump queue wait statistics as JSON\n"
            "left/right          seek backward/forward 10 seconds or to custom interval if -seek_interval is set\n"
            "down/up             seek backward/forward 1 minute\n"
            "page down/page up   seek backward/forward 10 minutes\n"
@@ -580,6 +1179,119 @@ void show_help_default(const char *opt, const char *arg)
            );
 }
 
+static void startup_mark(const char *what)
+{
+    int i;
+
+    if (!startup_trace)
+        return;
+    if (SDL_AtomicGet(&startup_reported)) {
+        av_log(NULL, AV_LOG_INFO, "startup: %9.1f ms  %s\n", (av_gettime_relative() - startup_time) / 1000.0, what);
+        return;
+    }
+    i = SDL_AtomicAdd(&nb_startup_marks, 1);
+    if (i < STARTUP_TRACE_MAX) {
+        startup_marks[i].time = av_gettime_relative();
+        SDL_AtomicSetPtr((void **)&startup_marks[i].what, (void *)what);
+    }
+}
+
+static int cmp_startup_marks(const void *a, const void *b)
+{
+    const StartupMark *ma = a, *mb = b;
+    return FFDIFFSIGN(ma->time, mb->time);
+}
+
+/* print the marks so far in time order, later marks are logged as they come */
+static void startup_report(const char *what)
+{
+    StartupMark marks[STARTUP_TRACE_MAX];
+    int64_t prev = startup_time;
+    int i, n = 0;
+
+    startup_mark(what);
+    SDL_AtomicSet(&startup_reported, 1);
+    for (i = 0; i < FFMIN(SDL_AtomicGet(&nb_startup_marks), STARTUP_TRACE_MAX); i++) {
+        if (SDL_AtomicGetPtr((void **)&startup_marks[i].what))
+            marks[n++] = startup_marks[i];
+    }
+    qsort(marks, n, sizeof(*marks), cmp_startup_marks);
+
+    av_log(NULL, AV_LOG_INFO, "Startup trace, ms since main() and since the previous mark (threads overlap):\n");
+    for (i = 0; i < n; i++) {
+        av_log(NULL, AV_LOG_INFO, "%9.1f %+9.1f  %s\n",
+               (marks[i].time - startup_time) / 1000.0, (marks[i].time - prev) / 1000.0, marks[i].what);
+        prev = marks[i].time;
+    }
+}
+
+static void set_display_ready(void)
+{
+    SDL_LockMutex(display_mutex);
+    display_ready = 1;
+    SDL_CondBroadcast(display_cond);
+    SDL_UnlockMutex(display_mutex);
+}
+
+/* the video filters need the renderer's texture formats */
+static void wait_display_ready(void)
+{
+    if (display_disable)
+        return;
+    SDL_LockMutex(display_mutex);
+    while (!display_ready)
+        SDL_CondWait(display_cond, display_mutex);
+    SDL_UnlockMutex(display_mutex);
+}
+
+static void wait_hist_add(WaitHistogram *h, int64_t us)
+{
+    int v = av_clip64(us, 0, INT_MAX);
+    int max;
+
+    SDL_AtomicAdd(&h->buckets[v ? FFMIN(av_log2(v) + 1, WAIT_HIST_BUCKETS - 1) : 0], 1);
+    while ((max = SDL_AtomicGet(&h->max)) < v && !SDL_AtomicCAS(&h->max, max, v))
+        ;
+}
+
+/* upper bound in microseconds of the bucket holding the q-quantile */
+static int64_t wait_hist_quantile(const int *buckets, int count, double q)
+{
+    int64_t target = ceil(count * q);
+    int64_t seen = 0;
+    int i;
+
+    for (i = 0; i < WAIT_HIST_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= target)
+            break;
+    }
+    return count ? 1LL << i : 0;
+}
+
+static void queued_mem_add(int64_t delta)
+{
+    SDL_AtomicLock(&queued_mem_lock);
+    queued_mem += delta;
+    SDL_AtomicUnlock(&queued_mem_lock);
+}
+
+/* Over -max_mem the read thread and the decoders stop working ahead, even
+ * with -infbuf; the budget covers the packets and frames of all inputs. A
+ * budget below a few decoded pictures, about 40M for 4K, leaves playback
+ * running from an almost empty queue. */
+static int queued_mem_over(void)
+{
+    int64_t mem;
+
+    if (max_mem <= 0)
+        return 0;
+    SDL_AtomicLock(&queued_mem_lock);
+    mem = queued_mem;
+    SDL_AtomicUnlock(&queued_mem_lock);
+    return mem > max_mem;
+}
+
 static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
 {
     MyAVPacketList pkt1;
@@ -597,35 +1309,126 @@ static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
 
     q->nb_packets++;
     q->size += pkt1.pkt->size + sizeof(pkt1);
+    queued_mem_add(pkt1.pkt->size + sizeof(pkt1));
     q->duration += pkt1.pkt->duration;
-
-    SDL_CondSignal(q->cond);
     return 0;
 }
 
+static AVPacket *packet_pool_get(PacketPool *p)
+{
+    if (p->nb_pkts > 0) {
+        p->hits++;
+        return p->pkts[--p->nb_pkts];
+    }
+    p->misses++;
+    return av_packet_alloc();
+}
+
+static void packet_pool_put(PacketPool *p, AVPacket **pkt)
+{
+    if (!*pkt)
+        return;
+    av_packet_unref(*pkt);
+    if (p->nb_pkts < p->max_pkts) {
+        p->pkts[p->nb_pkts++] = *pkt;
+        *pkt = NULL;
+    } else {
+        av_packet_free(pkt);
+    }
+}
+
+static void packet_pool_destroy(PacketPool *p)
+{
+    while (p->nb_pkts > 0)
+        av_packet_free(&p->pkts[--p->nb_pkts]);
+    av_freep(&p->pkts);
+}
+
 static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
     AVPacket *pkt1;
     int ret;
 
-    pkt1 = av_packet_alloc();
+    SDL_LockMutex(q->mutex);
+    pkt1 = packet_pool_get(&q->pool);
     if (!pkt1)
     {
+            SDL_UnlockMutex(q->mutex);
             av_packet_unref(pkt);
             return -1;
     }
     av_packet_move_ref(pkt1, pkt);
 
-    SDL_LockMutex(q->mutex);
     ret = packet_queue_put_private(q, pkt1);
+    if (ret < 0)
+            packet_pool_put(&q->pool, &pkt1);
+    else
+            SDL_CondSignal(q->cond);
     SDL_UnlockMutex(q->mutex);
 
-    if (ret < 0)
-            av_packet_free(&pkt1);
+    return ret;
+}
+
+/* Move nb_pkts packets into the queue under one lock and wake the consumer
+ * once. All of them are dropped if the queue was flushed since serial was
+ * read from it, -1 skips that check. */
+static int packet_queue_put_batch(PacketQueue *q, AVPacket **pkts, int nb_pkts, int serial)
+{
+    int i = 0, ret = 0;
+
+    SDL_LockMutex(q->mutex);
+    if (serial >= 0 && serial != q->serial)
+            ret = -1;
+    for (; !ret && i < nb_pkts; i++)
+    {
+            AVPacket *pkt1 = packet_pool_get(&q->pool);
+            if (!pkt1)
+            {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            av_packet_move_ref(pkt1, pkts[i]);
+            if ((ret = packet_queue_put_private(q, pkt1)) < 0)
+            {
+                packet_pool_put(&q->pool, &pkt1);
+                break;
+            }
+    }
+    if (i)
+            SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
 
+    for (; i < nb_pkts; i++)
+            av_packet_unref(pkts[i]);
     return ret;
 }
 
+static int packet_queue_put_staged(PacketQueue *q)
+{
+    int nb_staged = q->nb_staged;
+
+    q->nb_staged = 0;
+    return nb_staged ? packet_queue_put_batch(q, q->staged, nb_staged, q->staged_serial) : 0;
+}
+
+/* Stage a packet on the producer side. The batch is handed over when it is
+ * full, or right away while the consumer is close to running dry, so that
+ * batching never holds back a decoder that is waiting. */
+static int packet_queue_stage(PacketQueue *q, AVPacket *pkt)
+{
+    if (!q->staged[q->nb_staged] && !(q->staged[q->nb_staged] = av_packet_alloc()))
+    {
+            av_packet_unref(pkt);
+            return AVERROR(ENOMEM);
+    }
+    if (!q->nb_staged)
+            q->staged_serial = q->serial;
+    av_packet_move_ref(q->staged[q->nb_staged++], pkt);
+    if (q->nb_staged == PACKET_BATCH_SIZE || q->nb_packets < PACKET_BATCH_SIZE)
+            return packet_queue_put_staged(q);
+    return 0;
+}
+
 static int packet_queue_put_nullpacket(PacketQueue *q, AVPacket *pkt, int stream_index)
 {
     pkt->stream_index = stream_index;
@@ -638,6 +1441,9 @@ static int packet_queue_init(PacketQueue *q)
     q->pkt_list = av_fifo_alloc2(1, sizeof(MyAVPacketList), AV_FIFO_FLAG_AUTO_GROW);
     if (!q->pkt_list)
             return AVERROR(ENOMEM);
+    q->pool.max_pkts = FFMAX(packet_pool_size, 0);
+    if (q->pool.max_pkts && !(q->pool.pkts = av_malloc_array(q->pool.max_pkts, sizeof(*q->pool.pkts))))
+            return AVERROR(ENOMEM);
     q->mutex = SDL_CreateMutex();
     if (!q->mutex)
     {
@@ -655,37 +1461,14 @@ static int packet_queue_init(PacketQueue *q)
     return 0;
 }
 
-static void stream_close(VideoState *is)
-{
-
-}
-
-static void do_exit(VideoState *is)
-{
-    if (is) {
-            stream_close(is);
-    }
-    if (renderer)
-            SDL_DestroyRenderer(renderer);
-    if (window)
-            SDL_DestroyWindow(window);
-    uninit_opts();
-    av_freep(&vfilters_list);
-    avformat_network_deinit();
-    if (show_status)
-            printf("\n");
-    SDL_Quit();
-    av_log(NULL, AV_LOG_QUIET, "%s", "");
-    exit(0);
-}
-
 static void packet_queue_flush(PacketQueue *q)
 {
     MyAVPacketList pkt1;
 
     SDL_LockMutex(q->mutex);
-    while (av_fifo_read(q->pkt_list, &pkt1, 1))
-            av_packet_free(&pkt1.pkt);
+    while (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0)
+            packet_pool_put(&q->pool, &pkt1.pkt);
+    queued_mem_add(-q->size);
     q->nb_packets = 0;
     q->size = 0;
     q->duration = 0;
@@ -695,7 +1478,14 @@ static void packet_queue_flush(PacketQueue *q)
 
 static void pakcet_queue_destroy(PacketQueue *q)
 {
+    int i;
+
     packet_queue_flush(q);
+    for (i = 0; i < PACKET_BATCH_SIZE; i++)
+            av_packet_free(&q->staged[i]);
+    av_log(NULL, AV_LOG_VERBOSE, "packet pool: %"PRId64" hits, %"PRId64" misses\n",
+           q->pool.hits, q->pool.misses);
+    packet_pool_destroy(&q->pool);
     av_fifo_freep2(&q->pkt_list);
     SDL_DestroyMutex(q->mutex);
     SDL_DestroyCond(q->cond);
@@ -717,10 +1507,24 @@ static void packet_queue_start(PacketQueue *q)
     SDL_UnlockMutex(q->mutex);
 }
 
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
+static void packet_queue_wake_reader(PacketQueue *q)
+{
+    if (!q->refill_cond)
+            return;
+    SDL_LockMutex(q->refill_mutex);
+    SDL_CondSignal(q->refill_cond);
+    SDL_UnlockMutex(q->refill_mutex);
+}
+
+/* Take up to max_pkts packets under one lock. Returns how many were taken,
+ * blocking until there is at least one if block is set, or -1 on abort. */
+static int packet_queue_get_batch(PacketQueue *q, AVPacket **pkts, int *serials, int max_pkts, int block)
 {
     MyAVPacketList pkt1;
-    int ret;
+    int ret = 0;
+    int refill = 0;
+    int starved = 0;
+    int64_t wait_start = 0;
 
     SDL_LockMutex(q->mutex);
 
@@ -732,37 +1536,75 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
             break;
             }
 
-            if (av_fifo_read(q->pkt_list, &pkt1, 1) >= 0)
+            while (ret < max_pkts && av_fifo_read(q->pkt_list, &pkt1, 1) >= 0)
             {
             q->nb_packets--;
             q->size -= pkt1.pkt->size + sizeof(MyAVPacketList);
+            queued_mem_add(-(int64_t)(pkt1.pkt->size + sizeof(MyAVPacketList)));
             q->duration -= pkt1.pkt->duration;
-            av_packet_move_ref(pkt, pkt1.pkt);
-            if (serial)
-                *serial = pkt1.serial;
-            av_packet_free(&pkt1.pkt);
-            ret = 1;
-            break;
+            av_packet_move_ref(pkts[ret], pkt1.pkt);
+            serials[ret++] = pkt1.serial;
+            packet_pool_put(&q->pool, &pkt1.pkt);
             }
-            else if (!block)
+            if (ret || !block)
             {
-            ret = 0;
+            refill = ret && (q->duration < q->refill_duration || !q->nb_packets);
             break;
             }
             else
             {
+            if (!starved++)
+            {
+                q->nb_underruns++;
+                wait_start = av_gettime_relative();
+            }
             SDL_CondWait(q->cond, q->mutex);
             }
     }
 
     SDL_UnlockMutex(q->mutex);
+
+    wait_hist_add(&q->get_wait, wait_start ? av_gettime_relative() - wait_start : 0);
+
+    /* the read thread sleeps until a queue drops below its read-ahead target */
+    if (refill)
+            packet_queue_wake_reader(q);
+    return ret;
+}
+
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *serial)
+{
+    int pkt_serial;
+    int ret = packet_queue_get_batch(q, &pkt, &pkt_serial, 1, block);
+
+    if (ret > 0 && serial)
+            *serial = pkt_serial;
     return ret;
 }
 
+/* bytes of the buffers a queued frame keeps alive */
+static int64_t frame_mem_size(Frame *vp)
+{
+    int64_t size = 0;
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(vp->frame->buf); i++)
+        if (vp->frame->buf[i])
+            size += vp->frame->buf[i]->size;
+    for (i = 0; i < vp->frame->nb_extended_buf; i++)
+        size += vp->frame->extended_buf[i]->size;
+    for (i = 0; i < vp->sub.num_rects; i++)
+        size += (int64_t)vp->sub.rects[i]->linesize[0] * vp->sub.rects[i]->h;
+    return size;
+}
+
 static void frame_queue_unref_item(Frame *vp)
 {
+    queued_mem_add(-vp->mem);
+    vp->mem = 0;
     av_frame_unref(vp->frame);
     avsubtitle_free(&vp->sub);
+    av_freep(&vp->sub_src);
 }
 
 static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int keep_last)
@@ -779,9 +1621,14 @@ static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int
             av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
             return AVERROR(ENOMEM);
     }
+    /* a queue keeping the shown frame needs a second slot for the next one */
+    max_size = av_clip(max_size, 1 + !!keep_last, FRAME_QUEUE_MAX_SIZE);
+    if (!(f->queue = av_calloc(max_size, sizeof(*f->queue))))
+            return AVERROR(ENOMEM);
     f->pktq = pktq;
-    f->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
+    f->max_size = max_size;
     f->keep_last = !!keep_last;
+    f->lockless = frame_queue_lockless;
     for (i = 0; i < f->max_size; ++i)
             if (!(f->queue[i].frame = av_frame_alloc()))
               return AVERROR(ENOMEM);
@@ -792,12 +1639,13 @@ static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int
 static void frame_queue_destroy(FrameQueue *f)
 {
     int i;
-    for (i = 0; i < f->size; ++i)
+    for (i = 0; i < f->max_size; ++i)
     {
             Frame *vp = &f->queue[i];
             frame_queue_unref_item(vp);
             av_frame_free(&vp->frame);
     }
+    av_freep(&f->queue);
 
     SDL_DestroyMutex(f->mutex);
     SDL_DestroyCond(f->cond);
@@ -825,13 +1673,68 @@ static Frame* frame_queue_peek_last(FrameQueue *f)
     return &f->queue[f->rindex];
 }
 
-static Frame* frame_queue_peek_writable(FrameQueue *f)
+/* whether a writer has to wait for the reader; over -max_mem only while the
+ * reader has a frame to consume, its frame_queue_next() is what wakes us */
+static int frame_queue_full(FrameQueue *f)
 {
+    return SDL_AtomicGet(&f->size) >= f->max_size ||
+           (SDL_AtomicGet(&f->size) - f->rindex_shown > 0 && queued_mem_over());
+}
+
+static int frame_queue_must_wait(FrameQueue *f, int writable)
+{
+    if (f->pktq->abort_request)
+            return 0;
+    if (writable)
+            return frame_queue_full(f);
+    return SDL_AtomicGet(&f->size) - f->rindex_shown <= 0;
+}
+
+/* returns the time spent blocked, in microseconds */
+static int64_t frame_queue_wait(FrameQueue *f, int writable)
+{
+    int64_t start = 0;
+
     SDL_LockMutex(f->mutex);
-    while (f->size >= f->max_size && !f->pktq->abort_request) {
+    if (f->lockless)
+            SDL_AtomicAdd(&f->waiters, 1);
+    while (frame_queue_must_wait(f, writable))
+    {
+            if (!start)
+                start = av_gettime_relative();
             SDL_CondWait(f->cond, f->mutex);
     }
+    if (f->lockless)
+            SDL_AtomicAdd(&f->waiters, -1);
+    SDL_UnlockMutex(f->mutex);
+    return start ? av_gettime_relative() - start : 0;
+}
+
+static void frame_queue_update_size(FrameQueue *f, int delta)
+{
+    if (f->lockless)
+    {
+            /* the full barrier of SDL_AtomicAdd orders it against the waiters
+             * check, so a side that went to sleep is always woken */
+            SDL_AtomicAdd(&f->size, delta);
+            if (SDL_AtomicGet(&f->waiters))
+                frame_queue_signal(f);
+            return;
+    }
+
+    SDL_LockMutex(f->mutex);
+    SDL_AtomicAdd(&f->size, delta);
+    SDL_CondSignal(f->cond);
     SDL_UnlockMutex(f->mutex);
+}
+
+static Frame* frame_queue_peek_writable(FrameQueue *f)
+{
+    int64_t waited = 0;
+
+    if (!f->lockless || frame_queue_must_wait(f, 1))
+            waited = frame_queue_wait(f, 1);
+    wait_hist_add(&f->write_wait, waited);
 
     if (f->pktq->abort_request)
             return NULL;
@@ -841,10 +1744,11 @@ static Frame* frame_queue_peek_writable(FrameQueue *f)
 
 static Frame* frame_queue_peek_readable(FrameQueue *f)
 {
-    SDL_LockMutex(f->mutex);
-    while (f->size - f->rindex_shown <= 0 && !f->pktq->abort_request)
-            SDL_CondWait(f->cond, f->mutex);
-    SDL_UnlockMutex(f->mutex);
+    int64_t waited = 0;
+
+    if (!f->lockless || frame_queue_must_wait(f, 0))
+            waited = frame_queue_wait(f, 0);
+    wait_hist_add(&f->read_wait, waited);
 
     if (f->pktq->abort_request)
             return NULL;
@@ -854,13 +1758,24 @@ static Frame* frame_queue_peek_readable(FrameQueue *f)
 
 static void frame_queue_push(FrameQueue *f)
 {
+    Frame *vp = &f->queue[f->windex];
+
+    vp->mem = frame_mem_size(vp);
+    queued_mem_add(vp->mem);
     if (++f->windex == f->max_size)
             f->windex = 0;
 
-    SDL_LockMutex(f->mutex);
-    f->size++;
-    SDL_CondSignal(f->cond);
-    SDL_UnlockMutex(f->mutex);
+    frame_queue_update_size(f, 1);
+}
+
+/* The frame kept on screen is left out of -max_mem: while it alone is
+ * bigger than the budget, the budget could never be met again. */
+static void frame_queue_release_shown(FrameQueue *f)
+{
+    Frame *vp = &f->queue[f->rindex];
+
+    queued_mem_add(-vp->mem);
+    vp->mem = 0;
 }
 
 static void frame_queue_next(FrameQueue *f)
@@ -868,6 +1783,7 @@ static void frame_queue_next(FrameQueue *f)
     if (f->keep_last && !f->rindex_shown)
     {
             f->rindex_shown = 1;
+            frame_queue_release_shown(f);
             return;
     }
 
@@ -875,10 +1791,9 @@ static void frame_queue_next(FrameQueue *f)
     if (++f->rindex == f->max_size)
             f->rindex = 0;
 
-    SDL_LockMutex(f->mutex);
-    f->size--;
-    SDL_CondSignal(f->cond);
-    SDL_UnlockMutex(f->mutex);
+    frame_queue_update_size(f, -1);
+    if (f->keep_last && SDL_AtomicGet(&f->size) > 0)
+            frame_queue_release_shown(f);
 }
 
 static int64_t frame_queue_last_pos(FrameQueue *f)
@@ -892,7 +1807,7 @@ static int64_t frame_queue_last_pos(FrameQueue *f)
 
 static int frame_queue_nb_remaining(FrameQueue *f)
 {
-    return f->size - f->rindex_shown;
+    return SDL_AtomicGet(&f->size) - f->rindex_shown;
 }
 
 static void sigterm_handler(int sig)
@@ -900,6 +1815,25 @@ static void sigterm_handler(int sig)
     exit(123);
 }
 
+/* Playback time in microseconds. With -vclock it is virtual time, which the
+ * refresh loop advances, otherwise the wall clock. */
+static int64_t clock_time_us(void)
+{
+    int64_t now;
+
+    if (!vclock_mode)
+            return av_gettime_relative();
+    SDL_AtomicLock(&vclock_lock);
+    now = vclock_now;
+    SDL_AtomicUnlock(&vclock_lock);
+    return now;
+}
+
+static double clock_time(void)
+{
+    return clock_time_us() / 1000000.0;
+}
+
 static double get_clock(Clock *c)
 {
     if (*c->queue_serial != c->serial)
@@ -908,7 +1842,7 @@ static double get_clock(Clock *c)
             return c->pts;
     else
     {
-            double time = av_gettime_relative() / 1000000.0;
+            double time = clock_time();
             return c->pts_drift + time - (time - c->last_updated) * (1.0 - c->speed);
     }
 }
@@ -923,7 +1857,7 @@ static void set_clock_at(Clock *c, double pts, int serial, double time)
 
 static void set_clock(Clock *c, double pts, int serial)
 {
-    double time = av_gettime_relative() / 1000000.0;
+    double time = clock_time();
     set_clock_at(c, pts, serial, time);
 }
 
@@ -941,21 +1875,3757 @@ static void init_clock(Clock *c, int *queue_serial)
     set_clock(c, NAN, -1);
 }
 
-static int read_thread(void *arg)
+static void sync_clock_to_slave(Clock *c, Clock *slave)
 {
-
+    double clock = get_clock(c);
+    double slave_clock = get_clock(slave);
+    if (!isnan(slave_clock) && (isnan(clock) || fabs(clock - slave_clock) > AV_NOSYNC_THRESHOLD))
+        set_clock(c, slave_clock, slave->serial);
 }
 
-static VideoState* stream_open(const char *filename, const AVInputFormat *iformat)
+static int get_master_sync_type(VideoState *is) {
+    if (is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+        if (is->video_st)
+            return AV_SYNC_VIDEO_MASTER;
+        else
+            return AV_SYNC_AUDIO_MASTER;
+    } else if (is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+        if (is->audio_st)
+            return AV_SYNC_AUDIO_MASTER;
+        else
+            return AV_SYNC_EXTERNAL_CLOCK;
+    } else {
+        return AV_SYNC_EXTERNAL_CLOCK;
+    }
+}
+
+/* get the current master clock value */
+static double get_master_clock(VideoState *is)
+{
+    double val;
+
+    switch (get_master_sync_type(is)) {
+        case AV_SYNC_VIDEO_MASTER:
+            val = get_clock(&is->vidclk);
+            break;
+        case AV_SYNC_AUDIO_MASTER:
+            val = get_clock(&is->audclk);
+            break;
+        default:
+            val = get_clock(&is->extclk);
+            break;
+    }
+    return val;
+}
+
+static void check_external_clock_speed(VideoState *is) {
+   if (is->video_stream >= 0 && is->videoq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES ||
+       is->audio_stream >= 0 && is->audioq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES) {
+       set_clock_speed(&is->extclk, FFMAX(EXTERNAL_CLOCK_SPEED_MIN, is->extclk.speed - EXTERNAL_CLOCK_SPEED_STEP));
+   } else if ((is->video_stream < 0 || is->videoq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES) &&
+              (is->audio_stream < 0 || is->audioq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES)) {
+       set_clock_speed(&is->extclk, FFMIN(EXTERNAL_CLOCK_SPEED_MAX, is->extclk.speed + EXTERNAL_CLOCK_SPEED_STEP));
+   } else {
+       double speed = is->extclk.speed;
+       if (speed != 1.0)
+           set_clock_speed(&is->extclk, speed + EXTERNAL_CLOCK_SPEED_STEP * (1.0 - speed) / fabs(1.0 - speed));
+   }
+}
+
+/* -lowlatency: play faster while more than the target is queued behind the
+ * newest packet read, slightly slower while less is */
+static void check_latency_speed(VideoState *is)
+{
+    double latency = is->live_pts - get_clock(&is->extclk);
+    double speed;
+
+    if (isnan(latency) || fabs(latency) > LOWLATENCY_MAX_ERROR)
+        return;
+    is->latency = isnan(is->latency) ? latency : is->latency + (latency - is->latency) / 64;
+    speed = av_clipd(1.0 + (is->latency - lowlatency) * LOWLATENCY_GAIN, LOWLATENCY_SPEED_MIN, LOWLATENCY_SPEED_MAX);
+    if (fabs(speed - is->extclk.speed) >= EXTERNAL_CLOCK_SPEED_STEP)
+        set_clock_speed(&is->extclk, speed);
+}
+
+static void wake_read_thread(VideoState *is)
+{
+    SDL_LockMutex(is->continue_read_mutex);
+    SDL_CondSignal(is->continue_read_thread);
+    SDL_UnlockMutex(is->continue_read_mutex);
+}
+
+/* wake refresh_loop_wait_event() if it sleeps without a frame deadline */
+static void refresh_loop_wake(VideoState *is)
+{
+    SDL_Event event;
+
+    if (!SDL_AtomicCAS(&is->refresh_waiting, 1, 0))
+        return;
+    event.type = FF_REFRESH_EVENT;
+    event.user.data1 = is;
+    SDL_PushEvent(&event);
+}
+
+static void stream_toggle_pause(VideoState *is)
+{
+    if (is->paused) {
+        is->frame_timer += clock_time() - is->vidclk.last_updated;
+        if (is->read_pause_return != AVERROR(ENOSYS)) {
+            is->vidclk.paused = 0;
+        }
+        set_clock(&is->vidclk, get_clock(&is->vidclk), is->vidclk.serial);
+    }
+    set_clock(&is->extclk, get_clock(&is->extclk), is->extclk.serial);
+    is->paused = is->audclk.paused = is->vidclk.paused = is->extclk.paused = !is->paused;
+    wake_read_thread(is);
+}
+
+static void toggle_pause(VideoState *is)
+{
+    stream_toggle_pause(is);
+    is->step = 0;
+}
+
+static void toggle_mute(VideoState *is)
+{
+    is->muted = !is->muted;
+}
+
+static void update_volume(VideoState *is, int sign, double step)
+{
+    double volume_level = is->audio_volume ? (20 * log(is->audio_volume / (double)SDL_MIX_MAXVOLUME) / log(10)) : -1000.0;
+    int new_volume = lrint(SDL_MIX_MAXVOLUME * pow(10.0, (volume_level + sign * step) / 20.0));
+    is->audio_volume = av_clip(is->audio_volume == new_volume ? (is->audio_volume + sign) : new_volume, 0, SDL_MIX_MAXVOLUME);
+}
+
+static void step_to_next_frame(VideoState *is)
+{
+    /* if the stream is paused unpause it, then step */
+    if (is->paused)
+        stream_toggle_pause(is);
+    is->step = 1;
+    /* also called from the read thread after a seek */
+    refresh_loop_wake(is);
+}
+
+/* seek in the stream */
+static void stream_seek(VideoState *is, int64_t pos, int64_t rel, int by_bytes)
+{
+    if (!is->seek_req) {
+        is->seek_pos = pos;
+        is->seek_rel = rel;
+        is->seek_flags &= ~AVSEEK_FLAG_BYTE;
+        if (by_bytes)
+            is->seek_flags |= AVSEEK_FLAG_BYTE;
+        is->seek_req = 1;
+        wake_read_thread(is);
+    }
+}
+
+static void calculate_display_rect(SDL_Rect *rect,
+                                   int scr_xleft, int scr_ytop, int scr_width, int scr_height,
+                                   int pic_width, int pic_height, AVRational pic_sar)
+{
+    AVRational aspect_ratio = pic_sar;
+    int64_t width, height, x, y;
+
+    if (av_cmp_q(aspect_ratio, av_make_q(0, 1)) <= 0)
+        aspect_ratio = av_make_q(1, 1);
+
+    aspect_ratio = av_mul_q(aspect_ratio, av_make_q(pic_width, pic_height));
+
+    /* XXX: we suppose the screen has a 1.0 pixel ratio */
+    height = scr_height;
+    width = av_rescale(height, aspect_ratio.num, aspect_ratio.den) & ~1;
+    if (width > scr_width) {
+        width = scr_width;
+        height = av_rescale(width, aspect_ratio.den, aspect_ratio.num) & ~1;
+    }
+    x = (scr_width - width) / 2;
+    y = (scr_height - height) / 2;
+    rect->x = scr_xleft + x;
+    rect->y = scr_ytop  + y;
+    rect->w = FFMAX((int)width,  1);
+    rect->h = FFMAX((int)height, 1);
+}
+
+static void set_default_window_size(int width, int height, AVRational sar)
+{
+    SDL_Rect rect;
+    int max_width  = screen_width  ? screen_width  : INT_MAX;
+    int max_height = screen_height ? screen_height : INT_MAX;
+    /* the mosaic window does not follow any single input */
+    if (mosaic)
+        return;
+    if (max_width == INT_MAX && max_height == INT_MAX)
+        max_height = height;
+    calculate_display_rect(&rect, 0, 0, max_width, max_height, width, height, sar);
+    default_width  = rect.w;
+    default_height = rect.h;
+}
+
+static int decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue, SDL_cond *empty_queue_cond)
+{
+    int i;
+
+    memset(d, 0, sizeof(Decoder));
+    d->pkt = av_packet_alloc();
+    if (!d->pkt)
+        return AVERROR(ENOMEM);
+    d->avctx = avctx;
+    d->queue = queue;
+    d->empty_queu_cond = empty_queue_cond;
+    d->start_pts = AV_NOPTS_VALUE;
+    d->pkt_serial = -1;
+    /* audio packets are small and many, take several per wake-up */
+    d->batch_size = avctx->codec_type == AVMEDIA_TYPE_AUDIO ? PACKET_BATCH_SIZE : 1;
+    for (i = 0; i < d->batch_size && d->batch_size > 1; i++)
+        if (!(d->batch[i] = av_packet_alloc()))
+            return AVERROR(ENOMEM);
+    return 0;
+}
+
+static void decoder_destroy(Decoder *d)
+{
+    int i;
+
+    av_packet_free(&d->pkt);
+    for (i = 0; i < PACKET_BATCH_SIZE; i++)
+        av_packet_free(&d->batch[i]);
+    av_freep(&d->stats.frame_times);
+    avcodec_free_context(&d->avctx);
+}
+
+static void decoder_abort(Decoder *d, FrameQueue *fq)
+{
+    packet_queue_abort(d->queue);
+    frame_queue_signal(fq);
+    SDL_WaitThread(d->decoder_tid, NULL);
+    d->decoder_tid = NULL;
+    packet_queue_flush(d->queue);
+}
+
+static void decoder_stats_frame(Decoder *d)
+{
+    DecoderStats *s = &d->stats;
+
+    s->nb_frames++;
+    if (bench) {
+        int64_t *times = av_fast_realloc(s->frame_times, &s->frame_times_size,
+                                         (s->nb_frame_times + 1) * sizeof(*s->frame_times));
+        if (times) {
+            s->frame_times = times;
+            s->frame_times[s->nb_frame_times++] = s->busy;
+        }
+    }
+    s->last_busy = s->busy;
+    s->busy = 0;
+}
+
+/* next packet for the decoder into d->pkt, from the queue or from the batch taken last time */
+static int decoder_get_packet(Decoder *d)
+{
+    if (d->batch_size <= 1)
+        return packet_queue_get(d->queue, d->pkt, 1, &d->pkt_serial);
+
+    if (d->batch_index == d->nb_batch) {
+        int ret = packet_queue_get_batch(d->queue, d->batch, d->batch_serial, d->batch_size, 1);
+        if (ret < 0)
+            return -1;
+        d->nb_batch = ret;
+        d->batch_index = 0;
+    }
+    /* a flush made the rest of the batch stale, drop it without looking at each packet */
+    if (d->batch_serial[d->batch_index] != d->queue->serial) {
+        while (d->batch_index < d->nb_batch)
+            av_packet_unref(d->batch[d->batch_index++]);
+        return decoder_get_packet(d);
+    }
+    av_packet_move_ref(d->pkt, d->batch[d->batch_index]);
+    d->pkt_serial = d->batch_serial[d->batch_index++];
+    return 1;
+}
+
+static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
+    int ret = AVERROR(EAGAIN);
+    int64_t start;
+
+    for (;;) {
+        if (d->queue->serial == d->pkt_serial) {
+            do {
+                if (d->queue->abort_request)
+                    return -1;
+
+                start = av_gettime_relative();
+                switch (d->avctx->codec_type) {
+                    case AVMEDIA_TYPE_VIDEO:
+                        ret = avcodec_receive_frame(d->avctx, frame);
+                        if (ret >= 0) {
+                            if (decoder_reorder_pts == -1) {
+                                frame->pts = frame->best_effort_timestamp;
+                            } else if (!decoder_reorder_pts) {
+                                frame->pts = frame->pkt_dts;
+                            }
+                        }
+                        break;
+                    case AVMEDIA_TYPE_AUDIO:
+                        ret = avcodec_receive_frame(d->avctx, frame);
+                        if (ret >= 0) {
+                            AVRational tb = (AVRational){1, frame->sample_rate};
+                            if (frame->pts != AV_NOPTS_VALUE)
+                                frame->pts = av_rescale_q(frame->pts, d->avctx->pkt_timebase, tb);
+                            else if (d->next_pts != AV_NOPTS_VALUE)
+                                frame->pts = av_rescale_q(d->next_pts, d->next_pts_tb, tb);
+                            if (frame->pts != AV_NOPTS_VALUE) {
+                                d->next_pts = frame->pts + frame->nb_samples;
+                                d->next_pts_tb = tb;
+                            }
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                d->stats.busy += av_gettime_relative() - start;
+                if (ret == AVERROR_EOF) {
+                    d->finished = d->pkt_serial;
+                    avcodec_flush_buffers(d->avctx);
+                    return 0;
+                }
+                if (ret >= 0) {
+                    decoder_stats_frame(d);
+                    return 1;
+                }
+            } while (ret != AVERROR(EAGAIN));
+        }
+
+        do {
+            if (d->queue->nb_packets == 0)
+                SDL_CondSignal(d->empty_queu_cond);
+            if (d->packet_pending) {
+                d->packet_pending = 0;
+            } else {
+                int old_serial = d->pkt_serial;
+                if (decoder_get_packet(d) < 0)
+                    return -1;
+                if (old_serial != d->pkt_serial) {
+                    avcodec_flush_buffers(d->avctx);
+                    d->finished = 0;
+                    d->next_pts = d->start_pts;
+                    d->next_pts_tb = d->start_pts_tb;
+                    /* pictures decoded from before the first keyframe are broken anyway */
+                    d->keyframe_wait = d->avctx->codec_type == AVMEDIA_TYPE_VIDEO ? KEYFRAME_WAIT_MAX : 0;
+                    d->keyframe_skipped = 0;
+                }
+                if (d->queue->serial == d->pkt_serial && d->pkt->data) {
+                    d->stats.nb_packets++;
+                    d->stats.nb_bytes += d->pkt->size;
+                }
+            }
+            if (d->queue->serial == d->pkt_serial) {
+                if (!d->keyframe_wait || !d->pkt->data || (d->pkt->flags & AV_PKT_FLAG_KEY)) {
+                    if (d->keyframe_skipped)
+                        av_log(NULL, AV_LOG_VERBOSE, "Skipped %d packets before the first keyframe\n", d->keyframe_skipped);
+                    d->keyframe_wait = d->keyframe_skipped = 0;
+                    break;
+                }
+                d->keyframe_wait--;
+                d->keyframe_skipped++;
+            }
+            av_packet_unref(d->pkt);
+        } while (1);
+
+        start = av_gettime_relative();
+        if (d->avctx->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+            int got_frame = 0;
+            ret = avcodec_decode_subtitle2(d->avctx, sub, &got_frame, d->pkt);
+            if (ret < 0) {
+                ret = AVERROR(EAGAIN);
+            } else {
+                if (got_frame && !d->pkt->data) {
+                    d->packet_pending = 1;
+                }
+                ret = got_frame ? 0 : (d->pkt->data ? AVERROR(EAGAIN) : AVERROR_EOF);
+            }
+            av_packet_unref(d->pkt);
+        } else {
+            if (avcodec_send_packet(d->avctx, d->pkt) == AVERROR(EAGAIN)) {
+                av_log(d->avctx, AV_LOG_ERROR, "Receive_frame and send_packet both returned EAGAIN, which is an API violation.\n");
+                d->packet_pending = 1;
+            } else {
+                av_packet_unref(d->pkt);
+            }
+        }
+        d->stats.busy += av_gettime_relative() - start;
+    }
+}
+
+static int decoder_start(Decoder *d, int (*fn)(void *), const char *thread_name, void* arg)
+{
+    /* the read thread may have started the queue already to hold packets while the decoder opened */
+    if (d->queue->abort_request)
+        packet_queue_start(d->queue);
+    d->decoder_tid = SDL_CreateThread(fn, thread_name, arg);
+    if (!d->decoder_tid) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static inline
+int cmp_audio_fmts(enum AVSampleFormat fmt1, int64_t channel_count1,
+                   enum AVSampleFormat fmt2, int64_t channel_count2)
+{
+    /* If channel count == 1, planar and non-planar formats are the same */
+    if (channel_count1 == 1 && channel_count2 == 1)
+        return av_get_packed_sample_fmt(fmt1) != av_get_packed_sample_fmt(fmt2);
+    else
+        return channel_count1 != channel_count2 || fmt1 != fmt2;
+}
+
+static int configure_filtergraph(AVFilterGraph *graph, const char *filtergraph,
+                                 AVFilterContext *source_ctx, AVFilterContext *sink_ctx)
+{
+    int ret, i;
+    int nb_filters = graph->nb_filters;
+    AVFilterInOut *outputs = NULL, *inputs = NULL;
+
+    if (filtergraph) {
+        outputs = avfilter_inout_alloc();
+        inputs  = avfilter_inout_alloc();
+        if (!outputs || !inputs) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+
+        outputs->name       = av_strdup("in");
+        outputs->filter_ctx = source_ctx;
+        outputs->pad_idx    = 0;
+        outputs->next       = NULL;
+
+        inputs->name        = av_strdup("out");
+        inputs->filter_ctx  = sink_ctx;
+        inputs->pad_idx     = 0;
+        inputs->next        = NULL;
+
+        if ((ret = avfilter_graph_parse_ptr(graph, filtergraph, &inputs, &outputs, NULL)) < 0)
+            goto fail;
+    } else {
+        if ((ret = avfilter_link(source_ctx, 0, sink_ctx, 0)) < 0)
+            goto fail;
+    }
+
+    /* Reorder the filters to ensure that inputs of the custom filters are merged first */
+    for (i = 0; i < graph->nb_filters - nb_filters; i++)
+        FFSWAP(AVFilterContext*, graph->filters[i], graph->filters[i + nb_filters]);
+
+    ret = avfilter_graph_config(graph, NULL);
+fail:
+    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&inputs);
+    return ret;
+}
+
+static int renderer_supports(enum AVPixelFormat format)
+{
+    int i, j;
+
+    for (i = 0; i < renderer_info.num_texture_formats; i++)
+        for (j = 0; j < FF_ARRAY_ELEMS(sdl_texture_format_map) - 1; j++)
+            if (renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt &&
+                sdl_texture_format_map[j].format == format)
+                return 1;
+    return 0;
+}
+
+static int configure_video_filters(AVFilterGraph *graph, VideoState *is, const char *vfilters, AVFrame *frame)
+{
+    enum AVPixelFormat pix_fmts[FF_ARRAY_ELEMS(sdl_texture_format_map) + AV_PIX_FMT_NB];
+    const AVPixFmtDescriptor *desc = NULL;
+    char sws_flags_str[512] = "";
+    char buffersrc_args[256];
+    int ret;
+    AVFilterContext *filt_src = NULL, *filt_out = NULL, *last_filter = NULL;
+    AVCodecParameters *codecpar = is->video_st->codecpar;
+    AVRational fr = av_guess_frame_rate(is->ic, is->video_st, NULL);
+    const AVDictionaryEntry *e = NULL;
+    int nb_pix_fmts = 0;
+    int i, j;
+    AVBufferSrcParameters *par = av_buffersrc_parameters_alloc();
+
+    if (!par)
+        return AVERROR(ENOMEM);
+
+    /* without a renderer (-bench) any format is accepted and converted later */
+    for (i = 0; i < renderer_info.num_texture_formats; i++) {
+        for (j = 0; j < FF_ARRAY_ELEMS(sdl_texture_format_map) - 1; j++) {
+            if (renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt) {
+                pix_fmts[nb_pix_fmts++] = sdl_texture_format_map[j].format;
+                break;
+            }
+        }
+    }
+    /* with -scale_threads the other formats leave the graph as they are and
+     * the scale pool converts them, see queue_picture() */
+    while (nb_pix_fmts && scale_threads && (desc = av_pix_fmt_desc_next(desc))) {
+        enum AVPixelFormat fmt = av_pix_fmt_desc_get_id(desc);
+
+        if (!(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)) &&
+            sws_isSupportedInput(fmt) && !renderer_supports(fmt))
+            pix_fmts[nb_pix_fmts++] = fmt;
+    }
+    pix_fmts[nb_pix_fmts] = AV_PIX_FMT_NONE;
+
+    while ((e = av_dict_iterate(sws_dict, e))) {
+        if (!strcmp(e->key, "sws_flags")) {
+            av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", "flags", e->value);
+        } else
+            av_strlcatf(sws_flags_str, sizeof(sws_flags_str), "%s=%s:", e->key, e->value);
+    }
+    if (strlen(sws_flags_str))
+        sws_flags_str[strlen(sws_flags_str)-1] = '\0';
+
+    graph->scale_sws_opts = av_strdup(sws_flags_str);
+
+    snprintf(buffersrc_args, sizeof(buffersrc_args),
+             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             frame->width, frame->height, frame->format,
+             is->video_st->time_base.num, is->video_st->time_base.den,
+             codecpar->sample_aspect_ratio.num, FFMAX(codecpar->sample_aspect_ratio.den, 1));
+    if (fr.num && fr.den)
+        av_strlcatf(buffersrc_args, sizeof(buffersrc_args), ":frame_rate=%d/%d", fr.num, fr.den);
+
+    if ((ret = avfilter_graph_create_filter(&filt_src,
+                                            avfilter_get_by_name("buffer"),
+                                            "ffplay_buffer", buffersrc_args, NULL,
+                                            graph)) < 0)
+        goto fail;
+    par->hw_frames_ctx = frame->hw_frames_ctx;
+    ret = av_buffersrc_parameters_set(filt_src, par);
+    if (ret < 0)
+        goto fail;
+
+    ret = avfilter_graph_create_filter(&filt_out,
+                                       avfilter_get_by_name("buffersink"),
+                                       "ffplay_buffersink", NULL, NULL, graph);
+    if (ret < 0)
+        goto fail;
+
+    if ((ret = av_opt_set_int_list(filt_out, "pix_fmts", pix_fmts,  AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
+        goto fail;
+
+    last_filter = filt_out;
+
+/* Note: this macro adds a filter before the lastly added filter, so the
+ * processing order of the filters is in reverse */
+#define INSERT_FILT(name, arg) do {                                          \
+    AVFilterContext *filt_ctx;                                               \
+                                                                             \
+    ret = avfilter_graph_create_filter(&filt_ctx,                            \
+                                       avfilter_get_by_name(name),           \
+                                       "ffplay_" name, arg, NULL, graph);    \
+    if (ret < 0)                                                             \
+        goto fail;                                                           \
+                                                                             \
+    ret = avfilter_link(filt_ctx, 0, last_filter, 0);                        \
+    if (ret < 0)                                                             \
+        goto fail;                                                           \
+                                                                             \
+    last_filter = filt_ctx;                                                  \
+} while (0)
+
+    if (autorotate) {
+        int32_t *displaymatrix = (int32_t *)av_stream_get_side_data(is->video_st, AV_PKT_DATA_DISPLAYMATRIX, NULL);
+        double theta = get_rotation(displaymatrix);
+
+        if (fabs(theta - 90) < 1.0) {
+            INSERT_FILT("transpose", "clock");
+        } else if (fabs(theta - 180) < 1.0) {
+            INSERT_FILT("hflip", NULL);
+            INSERT_FILT("vflip", NULL);
+        } else if (fabs(theta - 270) < 1.0) {
+            INSERT_FILT("transpose", "cclock");
+        } else if (fabs(theta) > 1.0) {
+            char rotate_buf[64];
+            snprintf(rotate_buf, sizeof(rotate_buf), "%f*PI/180", theta);
+            INSERT_FILT("rotate", rotate_buf);
+        }
+    }
+
+    if ((ret = configure_filtergraph(graph, vfilters, filt_src, last_filter)) < 0)
+        goto fail;
+
+    is->in_video_filter  = filt_src;
+    is->out_video_filter = filt_out;
+
+fail:
+    av_freep(&par);
+    return ret;
+}
+
+static int configure_audio_filters(VideoState *is, const char *afilters, int force_output_format)
+{
+    static const enum AVSampleFormat sample_fmts[] = { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE };
+    int sample_rates[2] = { 0, -1 };
+    AVFilterContext *filt_asrc = NULL, *filt_asink = NULL;
+    char aresample_swr_opts[512] = "";
+    const AVDictionaryEntry *e = NULL;
+    AVBPrint bp;
+    char asrc_args[256];
+    int ret;
+
+    avfilter_graph_free(&is->agraph);
+    if (!(is->agraph = avfilter_graph_alloc()))
+        return AVERROR(ENOMEM);
+    is->agraph->nb_threads = filter_nbthreads;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_AUTOMATIC);
+
+    while ((e = av_dict_iterate(swr_opts, e)))
+        av_strlcatf(aresample_swr_opts, sizeof(aresample_swr_opts), "%s=%s:", e->key, e->value);
+    if (strlen(aresample_swr_opts))
+        aresample_swr_opts[strlen(aresample_swr_opts)-1] = '\0';
+    av_opt_set(is->agraph, "aresample_swr_opts", aresample_swr_opts, 0);
+
+    av_channel_layout_describe_bprint(&is->audio_filter_src.ch_layout, &bp);
+
+    ret = snprintf(asrc_args, sizeof(asrc_args),
+                   "sample_rate=%d:sample_fmt=%s:time_base=%d/%d:channel_layout=%s",
+                   is->audio_filter_src.freq, av_get_sample_fmt_name(is->audio_filter_src.fmt),
+                   1, is->audio_filter_src.freq, bp.str);
+
+    ret = avfilter_graph_create_filter(&filt_asrc,
+                                       avfilter_get_by_name("abuffer"), "ffplay_abuffer",
+                                       asrc_args, NULL, is->agraph);
+    if (ret < 0)
+        goto end;
+
+
+    ret = avfilter_graph_create_filter(&filt_asink,
+                                       avfilter_get_by_name("abuffersink"), "ffplay_abuffersink",
+                                       NULL, NULL, is->agraph);
+    if (ret < 0)
+        goto end;
+
+    if ((ret = av_opt_set_int_list(filt_asink, "sample_fmts", sample_fmts,  AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN)) < 0)
+        goto end;
+    if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 1, AV_OPT_SEARCH_CHILDREN)) < 0)
+        goto end;
+
+    if (force_output_format) {
+        av_bprint_clear(&bp);
+        av_channel_layout_describe_bprint(&is->audio_tgt.ch_layout, &bp);
+        sample_rates   [0] = is->audio_tgt.freq;
+        if ((ret = av_opt_set_int(filt_asink, "all_channel_counts", 0, AV_OPT_SEARCH_CHILDREN)) < 0)
+            goto end;
+        if ((ret = av_opt_set(filt_asink, "ch_layouts", bp.str, AV_OPT_SEARCH_CHILDREN)) < 0)
+            goto end;
+        if ((ret = av_opt_set_int_list(filt_asink, "sample_rates"   , sample_rates   ,  -1, AV_OPT_SEARCH_CHILDREN)) < 0)
+            goto end;
+    }
+
+
+    if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc, filt_asink)) < 0)
+        goto end;
+
+    is->in_audio_filter  = filt_asrc;
+    is->out_audio_filter = filt_asink;
+
+end:
+    if (ret < 0)
+        avfilter_graph_free(&is->agraph);
+    av_bprint_finalize(&bp, NULL);
+
+    return ret;
+}
+
+/* Pick how many frames the video decoder skips before decoding them, from
+ * the measured cost per second of video and from frames coming in late.
+ * Skips more at once, recovers a level at a time. */
+static void predrop_update(VideoState *is, double dpts)
+{
+    static const enum AVDiscard levels[] = { AVDISCARD_DEFAULT, AVDISCARD_NONREF, AVDISCARD_BIDIR, AVDISCARD_NONKEY };
+    static const char *const level_names[] = { "default", "nonref", "bidir", "nonkey" };
+    double media = dpts - is->predrop_last_pts;
+    double diff = dpts - get_master_clock(is);
+    int late, level = is->predrop_level;
+
+    is->predrop_last_pts = dpts;
+    if (!predrop || vclock_mode || bench ||
+        !(framedrop > 0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER))) {
+        level = 0;
+    } else {
+        /* the video this frame stands for, which grows with the frames skipped before it */
+        if (isnan(media) || media <= 0 || media > 1.0)
+            return;
+        is->predrop_load += ((is->viddec.stats.last_busy / 1000000.0 + is->render_cost) / media - is->predrop_load) / 16;
+        late = !isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD && diff < is->render_cost &&
+               is->viddec.pkt_serial == is->vidclk.serial;
+        if (is->predrop_hold > 0) {
+            is->predrop_hold--;
+            return;
+        }
+        if ((late || is->predrop_load > PREDROP_HIGH) && level < FF_ARRAY_ELEMS(levels) - 1) {
+            level++;
+            is->predrop_hold = PREDROP_HOLD_UP;
+        } else if (!late && is->predrop_load < PREDROP_LOW && level > 0) {
+            level--;
+            is->predrop_hold = PREDROP_HOLD_DOWN;
+        }
+    }
+    if (level == is->predrop_level)
+        return;
+    av_log(NULL, AV_LOG_VERBOSE, "Video load %.2f, skipping %s frames\n", is->predrop_load, level_names[level]);
+    is->predrop_level = level;
+    is->viddec.avctx->skip_frame = FFMAX(is->skip_frame_base, levels[level]);
+}
+
+static int get_video_frame(VideoState *is, AVFrame *frame)
+{
+    int got_picture;
+
+    if ((got_picture = decoder_decode_frame(&is->viddec, frame, NULL)) < 0)
+        return -1;
+
+    /* decoded from a packet taken before a seek, do not filter it */
+    if (got_picture && is->viddec.pkt_serial != is->videoq.serial) {
+        av_frame_unref(frame);
+        got_picture = 0;
+    }
+
+    if (got_picture) {
+        double dpts = NAN;
+
+        if (is->viddec.stats.nb_frames == 1)
+            startup_mark("first video frame decoded");
+        if (frame->pts != AV_NOPTS_VALUE)
+            dpts = av_q2d(is->video_st->time_base) * frame->pts;
+
+        frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st, frame);
+        predrop_update(is, dpts);
+
+        /* early drops depend on how fast the decoder runs, keep virtual clock runs reproducible */
+        if (!vclock_mode && (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER))) {
+            if (frame->pts != AV_NOPTS_VALUE) {
+                double diff = dpts - get_master_clock(is);
+                if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
+                    diff - is->frame_last_filter_delay < 0 &&
+                    is->viddec.pkt_serial == is->vidclk.serial &&
+                    is->videoq.nb_packets) {
+                    is->frame_drops_early++;
+                    av_frame_unref(frame);
+                    got_picture = 0;
+                }
+            }
+        }
+    }
+
+    return got_picture;
+}
+
+/* plane pointers of frame starting at row y, y a multiple of the chroma subsampling */
+static void scale_band(const AVFrame *frame, int y, uint8_t *data[4], int linesize[4])
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        int shift = (i == 1 || i == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) ? desc->log2_chroma_h : 0;
+
+        data[i] = frame->data[i] ? frame->data[i] + (y >> shift) * frame->linesize[i] : NULL;
+        linesize[i] = frame->linesize[i];
+    }
+}
+
+/* full range input, whether flagged on the frame or implied by a yuvj format */
+static int scale_src_full_range(const AVFrame *frame)
+{
+    return frame->color_range == AVCOL_RANGE_JPEG ||
+           frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P ||
+           frame->format == AV_PIX_FMT_YUVJ444P || frame->format == AV_PIX_FMT_YUVJ440P ||
+           frame->format == AV_PIX_FMT_YUVJ411P;
+}
+
+static int scale_slice(ScaleJob *job, int slice)
+{
+    ScaleSlice *s = &job->slices[slice];
+    uint8_t *src[4], *dst[4];
+    int src_linesize[4], dst_linesize[4];
+    int y = slice * job->slice_h;
+    int h = FFMIN(job->slice_h, job->src->height - y);
+    int src_range = scale_src_full_range(job->src);
+    int dst_range = job->dst->color_range == AVCOL_RANGE_JPEG;
+
+    /* the yuv2rgb tables are rebuilt by each sws_setColorspaceDetails(),
+     * so only a new context or new details pay for it */
+    if (!s->ctx || s->width != job->src->width || s->height != h ||
+        s->src_format != job->src->format || s->dst_format != job->dst->format) {
+        s->ctx = sws_getCachedContext(s->ctx,
+            job->src->width, h, job->src->format, job->dst->width, h, job->dst->format,
+            sws_flags, NULL, NULL, NULL);
+        if (!s->ctx) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot initialize the conversion context\n");
+            return AVERROR(EINVAL);
+        }
+        s->width = job->src->width;
+        s->height = h;
+        s->src_format = job->src->format;
+        s->dst_format = job->dst->format;
+        s->colorspace = -1;
+    }
+    if (s->colorspace != job->src->colorspace || s->src_range != src_range || s->dst_range != dst_range) {
+        sws_setColorspaceDetails(s->ctx,
+            sws_getCoefficients(job->src->colorspace), src_range,
+            sws_getCoefficients(job->src->colorspace), dst_range,
+            0, 1 << 16, 1 << 16);
+        s->colorspace = job->src->colorspace;
+        s->src_range = src_range;
+        s->dst_range = dst_range;
+    }
+    scale_band(job->src, y, src, src_linesize);
+    scale_band(job->dst, y, dst, dst_linesize);
+    return sws_scale(s->ctx, (const uint8_t * const *)src, src_linesize, 0, h, dst, dst_linesize);
+}
+
+static int scale_pool_worker(void *arg)
+{
+    ScalePool *p = arg;
+
+    SDL_LockMutex(p->mutex);
+    for (;;) {
+        ScaleJob *job;
+        int slice;
+
+        while (!p->abort && !p->first_job)
+            SDL_CondWait(p->work_cond, p->mutex);
+        if (p->abort)
+            break;
+        job = p->first_job;
+        slice = job->next_slice++;
+        if (job->next_slice == job->nb_slices && !(p->first_job = job->next))
+            p->last_job = NULL;
+        SDL_UnlockMutex(p->mutex);
+        scale_slice(job, slice);
+        SDL_LockMutex(p->mutex);
+        if (!--job->slices_left) {
+            av_frame_unref(job->src);
+            av_frame_unref(job->dst);
+            job->done = job->id;
+            SDL_CondBroadcast(p->done_cond);
+        }
+    }
+    SDL_UnlockMutex(p->mutex);
+    return 0;
+}
+
+/* called once every player is closed, no job is left */
+static void scale_pool_free(ScalePool **pp)
+{
+    ScalePool *p = *pp;
+    int i;
+
+    if (!p)
+        return;
+    SDL_LockMutex(p->mutex);
+    p->abort = 1;
+    SDL_CondBroadcast(p->work_cond);
+    SDL_UnlockMutex(p->mutex);
+    for (i = 0; i < p->nb_threads; i++)
+        SDL_WaitThread(p->threads[i], NULL);
+    SDL_DestroyCond(p->work_cond);
+    SDL_DestroyCond(p->done_cond);
+    SDL_DestroyMutex(p->mutex);
+    av_freep(pp);
+}
+
+static ScalePool *scale_pool_alloc(void)
+{
+    ScalePool *p = av_mallocz(sizeof(*p));
+
+    if (!p)
+        return NULL;
+    p->mutex = SDL_CreateMutex();
+    p->work_cond = SDL_CreateCond();
+    p->done_cond = SDL_CreateCond();
+    if (!p->mutex || !p->work_cond || !p->done_cond)
+        scale_pool_free(&p);
+    return p;
+}
+
+/* with p->mutex held */
+static int scale_pool_start(ScalePool *p)
+{
+    int threads = scale_threads;
+
+    if (p->nb_threads)
+        return 0;
+    if (threads < 0)
+        threads = av_cpu_count() / FFMAX(host_players, 1);
+    threads = av_clip(threads, 1, MAX_AUTO_THREADS);
+    for (; p->nb_threads < threads; p->nb_threads++) {
+        p->threads[p->nb_threads] = SDL_CreateThread(scale_pool_worker, "scale", p);
+        if (!p->threads[p->nb_threads]) {
+            av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+            break;
+        }
+    }
+    if (!p->nb_threads)
+        return AVERROR(ENOMEM);
+    av_log(NULL, AV_LOG_VERBOSE, "Converting pictures on %d threads\n", p->nb_threads);
+    return 0;
+}
+
+static void scale_job_free(ScalePool *p, ScaleJob **pjob)
+{
+    ScaleJob *job = *pjob;
+    int i;
+
+    if (!job)
+        return;
+    SDL_LockMutex(p->mutex);
+    while (job->done != job->id)
+        SDL_CondWait(p->done_cond, p->mutex);
+    SDL_UnlockMutex(p->mutex);
+    for (i = 0; i < FF_ARRAY_ELEMS(job->slices); i++)
+        sws_freeContext(job->slices[i].ctx);
+    av_frame_free(&job->src);
+    av_frame_free(&job->dst);
+    av_freep(pjob);
+}
+
+static ScaleJob *scale_job_alloc(void)
+{
+    ScaleJob *job = av_mallocz(sizeof(*job));
+
+    if (!job)
+        return NULL;
+    job->src = av_frame_alloc();
+    job->dst = av_frame_alloc();
+    if (!job->src || !job->dst) {
+        av_frame_free(&job->src);
+        av_frame_free(&job->dst);
+        av_freep(&job);
+    }
+    return job;
+}
+
+/* Hand src over to the pool, to be converted into the buffers of dst once
+ * the previous picture of job is done. Returns the picture id to wait for. */
+static int64_t scale_pool_submit(ScalePool *p, ScaleJob *job, AVFrame *dst, AVFrame *src)
+{
+    int64_t id;
+    int ret;
+
+    SDL_LockMutex(p->mutex);
+    while (job->done != job->id)
+        SDL_CondWait(p->done_cond, p->mutex);
+    if ((ret = scale_pool_start(p)) < 0 ||
+        (ret = av_frame_ref(job->dst, dst)) < 0) {
+        SDL_UnlockMutex(p->mutex);
+        return ret;
+    }
+    av_frame_move_ref(job->src, src);
+    job->nb_slices = av_clip(job->src->height / SCALE_MIN_SLICE_H, 1, p->nb_threads);
+    job->slice_h = FFALIGN((job->src->height + job->nb_slices - 1) / job->nb_slices, 16);
+    job->nb_slices = (job->src->height + job->slice_h - 1) / job->slice_h;
+    job->next_slice = 0;
+    job->slices_left = job->nb_slices;
+    job->next = NULL;
+    if (p->last_job)
+        p->last_job->next = job;
+    else
+        p->first_job = job;
+    p->last_job = job;
+    id = ++job->id;
+    SDL_CondBroadcast(p->work_cond);
+    SDL_UnlockMutex(p->mutex);
+    return id;
+}
+
+static void scale_pool_wait(ScalePool *p, ScaleJob *job, int64_t id)
+{
+    SDL_LockMutex(p->mutex);
+    while (job->done < id)
+        SDL_CondWait(p->done_cond, p->mutex);
+    SDL_UnlockMutex(p->mutex);
+}
+
+/* Start converting src into vp->frame when the renderer cannot take its format. */
+static int queue_picture_convert(VideoState *is, Frame *vp, AVFrame *src_frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src_frame->format);
+    enum AVPixelFormat format;
+    int64_t id;
+    int ret;
+
+    vp->scale_id = 0;
+    if (!scale_threads || !renderer_info.num_texture_formats || renderer_supports(src_frame->format)) {
+        av_frame_move_ref(vp->frame, src_frame);
+        return 0;
+    }
+
+    if (!is->scale_job) {
+        if (!(is->scale_job = scale_job_alloc()))
+            return AVERROR(ENOMEM);
+        av_log(NULL, AV_LOG_VERBOSE, "Converting %s pictures for display\n", desc->name);
+    }
+
+    /* swscale keeps the matrix and range of yuv to yuv conversions, so only
+     * what set_sdl_yuv_conversion_mode() can render stays yuv; BGRA gets
+     * the source matrix and range applied by swscale */
+    format = AV_PIX_FMT_BGRA;
+    if (!(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_ALPHA)) && renderer_supports(AV_PIX_FMT_YUV420P) &&
+        !scale_src_full_range(src_frame) &&
+        (src_frame->colorspace == AVCOL_SPC_BT709 || src_frame->colorspace == AVCOL_SPC_BT470BG ||
+         src_frame->colorspace == AVCOL_SPC_SMPTE170M || src_frame->colorspace == AVCOL_SPC_UNSPECIFIED))
+        format = AV_PIX_FMT_YUV420P;
+    vp->frame->format = format;
+    vp->frame->width = src_frame->width;
+    vp->frame->height = src_frame->height;
+    if ((ret = av_frame_get_buffer(vp->frame, 0)) < 0 ||
+        (ret = av_frame_copy_props(vp->frame, src_frame)) < 0)
+        return ret;
+    if (format == AV_PIX_FMT_BGRA) {
+        vp->frame->colorspace = AVCOL_SPC_RGB;
+        vp->frame->color_range = AVCOL_RANGE_JPEG;
+    }
+    if ((id = scale_pool_submit(scale_pool, is->scale_job, vp->frame, src_frame)) < 0)
+        return id;
+    vp->scale_id = id;
+    vp->format = format;
+    return 0;
+}
+
+static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double duration, int64_t pos, int serial)
+{
+    Frame *vp;
+    int ret;
+
+    /* flushed meanwhile, do not wait for a slot the display would only free to drop it */
+    if (serial != is->videoq.serial)
+        return 0;
+    if (!(vp = frame_queue_peek_writable(&is->pictq)))
+        return -1;
+
+    vp->sar = src_frame->sample_aspect_ratio;
+    vp->uploaded = 0;
+
+    vp->width = src_frame->width;
+    vp->height = src_frame->height;
+    vp->format = src_frame->format;
+
+    vp->pts = pts;
+    vp->duration = duration;
+    vp->pos = pos;
+    vp->serial = serial;
+
+    set_default_window_size(vp->width, vp->height, vp->sar);
+
+    if ((ret = queue_picture_convert(is, vp, src_frame)) < 0) {
+        av_frame_unref(vp->frame);
+        return ret;
+    }
+    frame_queue_push(&is->pictq);
+    refresh_loop_wake(is);
+    return 0;
+}
+
+static int audio_thread(void *arg)
+{
+    VideoState *is = arg;
+    AVFrame *frame = av_frame_alloc();
+    Frame *af;
+    int last_serial = -1;
+    int reconfigure;
+    int got_frame = 0;
+    AVRational tb;
+    int ret = 0;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    do {
+        if ((got_frame = decoder_decode_frame(&is->auddec, frame, NULL)) < 0)
+            goto the_end;
+
+        /* decoded from a packet taken before a seek, do not filter it */
+        if (got_frame && is->auddec.pkt_serial != is->audioq.serial) {
+            av_frame_unref(frame);
+            got_frame = 0;
+        }
+
+        if (got_frame) {
+                tb = (AVRational){1, frame->sample_rate};
+
+                reconfigure =
+                    cmp_audio_fmts(is->audio_filter_src.fmt, is->audio_filter_src.ch_layout.nb_channels,
+                                   frame->format, frame->ch_layout.nb_channels)    ||
+                    av_channel_layout_compare(&is->audio_filter_src.ch_layout, &frame->ch_layout) ||
+                    is->audio_filter_src.freq           != frame->sample_rate ||
+                    is->auddec.pkt_serial               != last_serial;
+
+                if (reconfigure) {
+                    char buf1[1024], buf2[1024];
+                    av_channel_layout_describe(&is->audio_filter_src.ch_layout, buf1, sizeof(buf1));
+                    av_channel_layout_describe(&frame->ch_layout, buf2, sizeof(buf2));
+                    av_log(NULL, AV_LOG_DEBUG,
+                           "Audio frame changed from rate:%d ch:%d fmt:%s layout:%s serial:%d to rate:%d ch:%d fmt:%s layout:%s serial:%d\n",
+                           is->audio_filter_src.freq, is->audio_filter_src.ch_layout.nb_channels, av_get_sample_fmt_name(is->audio_filter_src.fmt), buf1, last_serial,
+                           frame->sample_rate, frame->ch_layout.nb_channels, av_get_sample_fmt_name(frame->format), buf2, is->auddec.pkt_serial);
+
+                    is->audio_filter_src.fmt            = frame->format;
+                    ret = av_channel_layout_copy(&is->audio_filter_src.ch_layout, &frame->ch_layout);
+                    if (ret < 0)
+                        goto the_end;
+                    is->audio_filter_src.freq           = frame->sample_rate;
+                    last_serial                         = is->auddec.pkt_serial;
+
+                    if ((ret = configure_audio_filters(is, afilters, 1)) < 0)
+                        goto the_end;
+                }
+
+            if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
+                goto the_end;
+
+            while ((ret = av_buffersink_get_frame_flags(is->out_audio_filter, frame, 0)) >= 0) {
+                tb = av_buffersink_get_time_base(is->out_audio_filter);
+                if (!(af = frame_queue_peek_writable(&is->sampq)))
+                    goto the_end;
+
+                af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+                af->pos = frame->pkt_pos;
+                af->serial = is->auddec.pkt_serial;
+                af->duration = av_q2d((AVRational){frame->nb_samples, frame->sample_rate});
+
+                av_frame_move_ref(af->frame, frame);
+                frame_queue_push(&is->sampq);
+
+                if (is->audioq.serial != is->auddec.pkt_serial)
+                    break;
+            }
+            if (ret == AVERROR_EOF)
+                is->auddec.finished = is->auddec.pkt_serial;
+        }
+    } while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
+ the_end:
+    avfilter_graph_free(&is->agraph);
+    av_frame_free(&frame);
+    return ret;
+}
+
+static VideoFilterCacheEntry *vfilter_cache_find(VideoFilterCacheEntry *cache, const char *vfilters, const AVFrame *frame)
+{
+    int i;
+
+    /* the buffer source of a graph is bound to the hardware frames context it was built with */
+    if (frame->hw_frames_ctx)
+        return NULL;
+    for (i = 0; i < VFILTER_CACHE_SIZE; i++) {
+        VideoFilterCacheEntry *e = &cache[i];
+
+        if (e->graph && e->width == frame->width && e->height == frame->height &&
+            e->format == frame->format && !av_cmp_q(e->sar, frame->sample_aspect_ratio) &&
+            !strcmp(av_x_if_null(e->vfilters, ""), av_x_if_null(vfilters, "")))
+            return e;
+    }
+    return NULL;
+}
+
+/* a free slot, or the least recently used one emptied */
+static VideoFilterCacheEntry *vfilter_cache_slot(VideoFilterCacheEntry *cache)
+{
+    VideoFilterCacheEntry *lru = &cache[0];
+    int i;
+
+    for (i = 0; i < VFILTER_CACHE_SIZE; i++) {
+        if (!cache[i].graph)
+            return &cache[i];
+        if (cache[i].last_used < lru->last_used)
+            lru = &cache[i];
+    }
+    avfilter_graph_free(&lru->graph);
+    return lru;
+}
+
+static void vfilter_cache_clear(VideoFilterCacheEntry *cache)
+{
+    int i;
+
+    for (i = 0; i < VFILTER_CACHE_SIZE; i++)
+        avfilter_graph_free(&cache[i].graph);
+}
+
+static int video_thread(void *arg)
+{
+    VideoState *is = arg;
+    AVFrame *frame = av_frame_alloc();
+    double pts;
+    double duration;
+    int ret;
+    AVRational tb = is->video_st->time_base;
+    AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, NULL);
+
+    VideoFilterCacheEntry graphs[VFILTER_CACHE_SIZE] = { { 0 } };
+    VideoFilterCacheEntry *entry;
+    int64_t graph_uses = 0;
+    int graph_reused = 0;
+    double last_pts = NAN;
+    AVFilterContext *filt_out = NULL, *filt_in = NULL;
+    int last_w = 0;
+    int last_h = 0;
+    enum AVPixelFormat last_format = -2;
+    AVRational last_sar = { 0, 1 };
+    int last_serial = -1;
+    int last_vfilter_idx = 0;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+
+    for (;;) {
+        ret = get_video_frame(is, frame);
+        if (ret < 0)
+            goto the_end;
+        if (!ret)
+            continue;
+
+        if (   last_w != frame->width
+            || last_h != frame->height
+            || last_format != frame->format
+            || av_cmp_q(last_sar, frame->sample_aspect_ratio)
+            || last_serial != is->viddec.pkt_serial
+            || last_vfilter_idx != is->vfilter_idx) {
+            const char *vfilters = vfilters_list ? vfilters_list[is->vfilter_idx] : NULL;
+
+            av_log(NULL, AV_LOG_DEBUG,
+                   "Video frame changed from size:%dx%d format:%s serial:%d to size:%dx%d format:%s serial:%d\n",
+                   last_w, last_h,
+                   (const char *)av_x_if_null(av_get_pix_fmt_name(last_format), "none"), last_serial,
+                   frame->width, frame->height,
+                   (const char *)av_x_if_null(av_get_pix_fmt_name(frame->format), "none"), is->viddec.pkt_serial);
+            /* what the graphs still buffer from before a seek must not come out after it */
+            if (last_serial != is->viddec.pkt_serial) {
+                vfilter_cache_clear(graphs);
+                last_pts = NAN;
+            }
+            entry = vfilter_cache_find(graphs, vfilters, frame);
+            graph_reused = !!entry;
+            if (entry) {
+                av_log(NULL, AV_LOG_DEBUG, "Reusing the cached filter graph\n");
+                is->in_video_filter  = entry->in;
+                is->out_video_filter = entry->out;
+            } else {
+                entry = vfilter_cache_slot(graphs);
+                entry->graph = avfilter_graph_alloc();
+                if (!entry->graph) {
+                    ret = AVERROR(ENOMEM);
+                    goto the_end;
+                }
+                entry->graph->nb_threads = filter_nbthreads;
+                wait_display_ready();
+                if ((ret = configure_video_filters(entry->graph, is, vfilters, frame)) < 0) {
+                    SDL_Event event;
+                    event.type = FF_QUIT_EVENT;
+                    event.user.data1 = is;
+                    SDL_PushEvent(&event);
+                    goto the_end;
+                }
+                entry->in  = is->in_video_filter;
+                entry->out = is->out_video_filter;
+                entry->vfilters = vfilters;
+                entry->width = frame->width;
+                entry->height = frame->height;
+                entry->format = frame->format;
+                entry->sar = frame->sample_aspect_ratio;
+            }
+            entry->last_used = ++graph_uses;
+            filt_in  = is->in_video_filter;
+            filt_out = is->out_video_filter;
+            last_w = frame->width;
+            last_h = frame->height;
+            last_format = frame->format;
+            last_sar = frame->sample_aspect_ratio;
+            last_serial = is->viddec.pkt_serial;
+            last_vfilter_idx = is->vfilter_idx;
+            frame_rate = av_buffersink_get_frame_rate(filt_out);
+        }
+
+        ret = av_buffersrc_add_frame(filt_in, frame);
+        if (ret < 0)
+            goto the_end;
+
+        while (ret >= 0) {
+            is->frame_last_returned_time = av_gettime_relative() / 1000000.0;
+
+            ret = av_buffersink_get_frame_flags(filt_out, frame, 0);
+            if (ret < 0) {
+                if (ret == AVERROR_EOF)
+                    is->viddec.finished = is->viddec.pkt_serial;
+                ret = 0;
+                break;
+            }
+
+            is->frame_last_filter_delay = av_gettime_relative() / 1000000.0 - is->frame_last_returned_time;
+            if (fabs(is->frame_last_filter_delay) > AV_NOSYNC_THRESHOLD / 10.0)
+                is->frame_last_filter_delay = 0;
+            tb = av_buffersink_get_time_base(filt_out);
+            duration = (frame_rate.num && frame_rate.den ? av_q2d((AVRational){frame_rate.den, frame_rate.num}) : 0);
+            pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+            /* a graph taken from the cache may still hold frames from its last use */
+            if (graph_reused && pts <= last_pts) {
+                av_frame_unref(frame);
+                continue;
+            }
+            graph_reused = 0;
+            if (!isnan(pts))
+                last_pts = pts;
+            ret = queue_picture(is, frame, pts, duration, frame->pkt_pos, is->viddec.pkt_serial);
+            av_frame_unref(frame);
+            if (is->videoq.serial != is->viddec.pkt_serial)
+                break;
+        }
+
+        if (ret < 0)
+            goto the_end;
+    }
+ the_end:
+    vfilter_cache_clear(graphs);
+    av_frame_free(&frame);
+    return 0;
+}
+
+static int subtitle_thread(void *arg)
+{
+    VideoState *is = arg;
+    Frame *sp;
+    int got_subtitle;
+    double pts;
+
+    for (;;) {
+        if (!(sp = frame_queue_peek_writable(&is->subq)))
+            return 0;
+
+        if ((got_subtitle = decoder_decode_frame(&is->subdec, NULL, &sp->sub)) < 0)
+            break;
+
+        pts = 0;
+
+        if (got_subtitle && sp->sub.format == 0) {
+            if (sp->sub.pts != AV_NOPTS_VALUE)
+                pts = sp->sub.pts / (double)AV_TIME_BASE;
+            sp->pts = pts;
+            sp->serial = is->subdec.pkt_serial;
+            sp->width = is->subdec.avctx->width;
+            sp->height = is->subdec.avctx->height;
+            sp->uploaded = 0;
+
+            /* now we can update the picture count */
+            frame_queue_push(&is->subq);
+        } else if (got_subtitle) {
+            avsubtitle_free(&sp->sub);
+        }
+    }
+    return 0;
+}
+
+/* copy samples for viewing in editor window */
+static void update_sample_display(VideoState *is, short *samples, int samples_size)
+{
+    int size, len;
+
+    size = samples_size / sizeof(short);
+    while (size > 0) {
+        len = SAMPLE_ARRAY_SIZE - is->sample_array_index;
+        if (len > size)
+            len = size;
+        memcpy(is->sample_array + is->sample_array_index, samples, len * sizeof(short));
+        samples += len;
+        is->sample_array_index += len;
+        if (is->sample_array_index >= SAMPLE_ARRAY_SIZE)
+            is->sample_array_index = 0;
+        size -= len;
+    }
+}
+
+/* return the wanted number of samples to get better sync if sync_type is video
+ * or external master clock */
+static int synchronize_audio(VideoState *is, int nb_samples)
+{
+    int wanted_nb_samples = nb_samples;
+
+    /* if not master, then we try to remove or add samples to correct the clock */
+    if (get_master_sync_type(is) != AV_SYNC_AUDIO_MASTER) {
+        double diff, avg_diff;
+        int min_nb_samples, max_nb_samples;
+
+        /* -lowlatency changes the external clock speed gradually, resample
+         * along with it rather than wait for the difference to build up */
+        if (lowlatency > 0 && get_master_sync_type(is) == AV_SYNC_EXTERNAL_CLOCK)
+            nb_samples = wanted_nb_samples = lrint(nb_samples / is->extclk.speed);
+
+        diff = get_clock(&is->audclk) - get_master_clock(is);
+
+        if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD) {
+            is->audio_diff_cum = diff + is->audio_diff_avg_coef * is->audio_diff_cum;
+            if (is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+                /* not enough measures to have a correct estimate */
+                is->audio_diff_avg_count++;
+            } else {
+                /* estimate the A-V difference */
+                avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+
+                if (fabs(avg_diff) >= is->audio_diff_threshold) {
+                    wanted_nb_samples = nb_samples + (int)(diff * is->audio_src.freq);
+                    min_nb_samples = ((nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100));
+                    max_nb_samples = ((nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100));
+                    wanted_nb_samples = av_clip(wanted_nb_samples, min_nb_samples, max_nb_samples);
+                }
+                av_log(NULL, AV_LOG_TRACE, "diff=%f adiff=%f sample_diff=%d apts=%0.3f %f\n",
+                        diff, avg_diff, wanted_nb_samples - nb_samples,
+                        is->audio_clock, is->audio_diff_threshold);
+            }
+        } else {
+            /* too big difference : may be initial PTS errors, so
+               reset A-V filter */
+            is->audio_diff_avg_count = 0;
+            is->audio_diff_cum       = 0;
+        }
+    }
+
+    return wanted_nb_samples;
+}
+
+/**
+ * Decode one audio frame and return its uncompressed size.
+ *
+ * The processed audio frame is decoded, converted if required, and
+ * stored in is->audio_buf, with size in bytes given by the return
+ * value.
+ */
+static int audio_decode_frame(VideoState *is)
+{
+    int data_size, resampled_data_size;
+    int wanted_nb_samples;
+    Frame *af;
+
+    if (is->paused)
+        return -1;
+
+    do {
+        /* the virtual output never waits, it only runs ahead of a full queue or at the end */
+        if (vclock_mode && frame_queue_nb_remaining(&is->sampq) == 0)
+            return -1;
+#if defined(_WIN32)
+        while (frame_queue_nb_remaining(&is->sampq) == 0) {
+            if ((clock_time_us() - audio_callback_time) > 1000000LL * is->audio_hw_buf_size / is->audio_tgt.bytes_per_sec / 2)
+                return -1;
+            av_usleep (1000);
+        }
+#endif
+        if (!(af = frame_queue_peek_readable(&is->sampq)))
+            return -1;
+        frame_queue_next(&is->sampq);
+    } while (af->serial != is->audioq.serial);
+
+    data_size = av_samples_get_buffer_size(NULL, af->frame->ch_layout.nb_channels,
+                                           af->frame->nb_samples,
+                                           af->frame->format, 1);
+
+    wanted_nb_samples = synchronize_audio(is, af->frame->nb_samples);
+
+    if (af->frame->format        != is->audio_src.fmt            ||
+        av_channel_layout_compare(&af->frame->ch_layout, &is->audio_src.ch_layout) ||
+        af->frame->sample_rate   != is->audio_src.freq           ||
+        (wanted_nb_samples       != af->frame->nb_samples && !is->swr_ctx)) {
+        swr_free(&is->swr_ctx);
+        swr_alloc_set_opts2(&is->swr_ctx,
+                            &is->audio_tgt.ch_layout, is->audio_tgt.fmt, is->audio_tgt.freq,
+                            &af->frame->ch_layout, af->frame->format, af->frame->sample_rate,
+                            0, NULL);
+        if (!is->swr_ctx || swr_init(is->swr_ctx) < 0) {
+            av_log(NULL, AV_LOG_ERROR,
+                   "Cannot create sample rate converter for conversion of %d Hz %s %d channels to %d Hz %s %d channels!\n",
+                    af->frame->sample_rate, av_get_sample_fmt_name(af->frame->format), af->frame->ch_layout.nb_channels,
+                    is->audio_tgt.freq, av_get_sample_fmt_name(is->audio_tgt.fmt), is->audio_tgt.ch_layout.nb_channels);
+            swr_free(&is->swr_ctx);
+            return -1;
+        }
+        if (av_channel_layout_copy(&is->audio_src.ch_layout, &af->frame->ch_layout) < 0)
+            return -1;
+        is->audio_src.freq = af->frame->sample_rate;
+        is->audio_src.fmt = af->frame->format;
+    }
+
+    if (is->swr_ctx) {
+        const uint8_t **in = (const uint8_t **)af->frame->extended_data;
+        uint8_t **out = &is->audio_buf1;
+        int out_count = (int64_t)wanted_nb_samples * is->audio_tgt.freq / af->frame->sample_rate + 256;
+        int out_size  = av_samples_get_buffer_size(NULL, is->audio_tgt.ch_layout.nb_channels, out_count, is->audio_tgt.fmt, 0);
+        int len2;
+        if (out_size < 0) {
+            av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size() failed\n");
+            return -1;
+        }
+        if (wanted_nb_samples != af->frame->nb_samples) {
+            if (swr_set_compensation(is->swr_ctx, (wanted_nb_samples - af->frame->nb_samples) * is->audio_tgt.freq / af->frame->sample_rate,
+                                        wanted_nb_samples * is->audio_tgt.freq / af->frame->sample_rate) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "swr_set_compensation() failed\n");
+                return -1;
+            }
+        }
+        av_fast_malloc(&is->audio_buf1, &is->audio_buf1_size, out_size);
+        if (!is->audio_buf1)
+            return AVERROR(ENOMEM);
+        len2 = swr_convert(is->swr_ctx, out, out_count, in, af->frame->nb_samples);
+        if (len2 < 0) {
+            av_log(NULL, AV_LOG_ERROR, "swr_convert() failed\n");
+            return -1;
+        }
+        if (len2 == out_count) {
+            av_log(NULL, AV_LOG_WARNING, "audio buffer is probably too small\n");
+            if (swr_init(is->swr_ctx) < 0)
+                swr_free(&is->swr_ctx);
+        }
+        is->audio_buf = is->audio_buf1;
+        resampled_data_size = len2 * is->audio_tgt.ch_layout.nb_channels * av_get_bytes_per_sample(is->audio_tgt.fmt);
+    } else {
+        is->audio_buf = af->frame->data[0];
+        resampled_data_size = data_size;
+    }
+
+    /* update the audio clock with the pts */
+    if (!isnan(af->pts))
+        is->audio_clock = af->pts + (double) af->frame->nb_samples / af->frame->sample_rate;
+    else
+        is->audio_clock = NAN;
+    is->audio_clock_serial = af->serial;
+    return resampled_data_size;
+}
+
+static int audio_ring_write(AudioRing *r, const uint8_t *src, int len)
+{
+    unsigned wpos = SDL_AtomicGet(&r->write_pos);
+    unsigned rpos = SDL_AtomicGet(&r->read_pos);
+    int off = wpos & (r->size - 1);
+    int n;
+
+    len = FFMIN(len, r->size - (int)(wpos - rpos));
+    n = FFMIN(len, r->size - off);
+    memcpy(r->data + off, src, n);
+    memcpy(r->data, src + n, len - n);
+    SDL_AtomicSet(&r->write_pos, wpos + len);
+    return len;
+}
+
+static int audio_ring_read(AudioRing *r, uint8_t *dst, int len)
+{
+    unsigned rpos = SDL_AtomicGet(&r->read_pos);
+    unsigned wpos = SDL_AtomicGet(&r->write_pos);
+    unsigned skip = SDL_AtomicGet(&r->skip_pos);
+    int off, n;
+
+    if ((int)(skip - rpos) > 0)
+        rpos = skip;
+    len = FFMIN(len, (int)(wpos - rpos));
+    off = rpos & (r->size - 1);
+    n = FFMIN(len, r->size - off);
+    memcpy(dst, r->data + off, n);
+    memcpy(dst + n, r->data, len - n);
+    SDL_AtomicSet(&r->read_pos, rpos + len);
+    return len;
+}
+
+static void audio_ring_set_clock(AudioRing *r, double clock, int serial, int pos)
+{
+    int seq = SDL_AtomicGet(&r->clock_seq);
+
+    SDL_AtomicSet(&r->clock_seq, seq + 1);
+    r->clock = clock;
+    r->clock_serial = serial;
+    r->clock_pos = pos;
+    SDL_AtomicSet(&r->clock_seq, seq + 2);
+}
+
+static void audio_ring_get_clock(AudioRing *r, double *clock, int *serial, int *pos)
+{
+    int seq;
+
+    do {
+        seq = SDL_AtomicGet(&r->clock_seq);
+        *clock = r->clock;
+        *serial = r->clock_serial;
+        *pos = r->clock_pos;
+    } while ((seq & 1) || seq != SDL_AtomicGet(&r->clock_seq));
+}
+
+/* callback side of the ring: only copies and scales, never decodes or waits */
+static void audio_ring_output(VideoState *is, Uint8 *stream, int len)
+{
+    AudioRing *r = &is->audio_ring;
+    double clock;
+    int serial, pos, pending;
+    int copied = 0;
+
+    while (!is->paused && copied < len) {
+        uint8_t *dst = stream + copied;
+        int got;
+
+        if (!is->muted && is->audio_volume == SDL_MIX_MAXVOLUME) {
+            got = audio_ring_read(r, dst, len - copied);
+        } else {
+            got = audio_ring_read(r, r->scratch, FFMIN(len - copied, r->scratch_size));
+            memset(dst, 0, got);
+            if (!is->muted)
+                SDL_MixAudioFormat(dst, r->scratch, AUDIO_S16SYS, got, is->audio_volume);
+        }
+        if (!got)
+            break;
+        copied += got;
+    }
+    memset(stream + copied, 0, len - copied);
+    SDL_SemPost(r->space);
+
+    if (!is->paused && copied < len) {
+        SDL_AtomicAdd(&is->audio_silence, 1);
+        if (is->auddec.finished != is->audioq.serial)
+            SDL_AtomicAdd(&is->audio_underruns, 1);
+    }
+
+    audio_ring_get_clock(r, &clock, &serial, &pos);
+    pending = pos - SDL_AtomicGet(&r->read_pos);
+    is->audio_write_buf_size = FFMAX(pending, 0);
+    /* Let's assume the audio driver that is used by SDL has two periods. */
+    if (!isnan(clock)) {
+        set_clock_at(&is->audclk, clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, serial, audio_callback_time / 1000000.0);
+        sync_clock_to_slave(&is->extclk, &is->audclk);
+    }
+}
+
+/* decodes and resamples ahead of the audio callback into the ring */
+static int audio_mixer_thread(void *arg)
+{
+    VideoState *is = arg;
+    AudioRing *r = &is->audio_ring;
+    int last_serial = -1;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    while (!SDL_AtomicGet(&is->audio_mixer_abort)) {
+        if (is->audio_buf_index >= is->audio_buf_size) {
+            int audio_size = audio_decode_frame(is);
+            if (audio_size < 0) {
+                /* paused or aborted */
+                SDL_SemWaitTimeout(r->space, 10);
+                continue;
+            }
+            if (is->audio_clock_serial != last_serial) {
+                /* what is left of the previous serial must not be played after a seek */
+                SDL_AtomicSet(&r->skip_pos, SDL_AtomicGet(&r->write_pos));
+                last_serial = is->audio_clock_serial;
+            }
+            if (is->show_mode != SHOW_MODE_VIDEO)
+                update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
+            is->audio_buf_size = audio_size;
+            is->audio_buf_index = 0;
+        }
+        is->audio_buf_index += audio_ring_write(r, is->audio_buf + is->audio_buf_index, is->audio_buf_size - is->audio_buf_index);
+        audio_ring_set_clock(r, is->audio_clock - (double)(is->audio_buf_size - is->audio_buf_index) / is->audio_tgt.bytes_per_sec,
+                             is->audio_clock_serial, SDL_AtomicGet(&r->write_pos));
+        if (is->audio_buf_index < is->audio_buf_size)
+            SDL_SemWaitTimeout(r->space, 10);
+    }
+    return 0;
+}
+
+static void audio_ring_free(AudioRing *r)
+{
+    av_freep(&r->data);
+    av_freep(&r->scratch);
+    if (r->space)
+        SDL_DestroySemaphore(r->space);
+    memset(r, 0, sizeof(*r));
+}
+
+static int audio_mixer_start(VideoState *is)
+{
+    AudioRing *r = &is->audio_ring;
+    int need = FFMAX(is->audio_tgt.bytes_per_sec / 1000 * AUDIO_RING_MSEC, 2 * is->audio_hw_buf_size);
+
+    audio_ring_free(r);
+    for (r->size = 1; r->size < need; r->size <<= 1)
+        ;
+    r->data = av_malloc(r->size);
+    r->scratch_size = is->audio_hw_buf_size;
+    r->scratch = av_malloc(r->scratch_size);
+    r->space = SDL_CreateSemaphore(0);
+    r->clock = NAN;
+    r->clock_serial = -1;
+    if (!r->data || !r->scratch || !r->space) {
+        audio_ring_free(r);
+        return AVERROR(ENOMEM);
+    }
+    SDL_AtomicSet(&is->audio_mixer_abort, 0);
+    is->audio_mixer_tid = SDL_CreateThread(audio_mixer_thread, "audio_mixer", is);
+    if (!is->audio_mixer_tid) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        audio_ring_free(r);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static void audio_mixer_stop(VideoState *is)
+{
+    if (!is->audio_mixer_tid)
+        return;
+    SDL_AtomicSet(&is->audio_mixer_abort, 1);
+    SDL_SemPost(is->audio_ring.space);
+    SDL_WaitThread(is->audio_mixer_tid, NULL);
+    is->audio_mixer_tid = NULL;
+}
+
+/* prepare a new audio buffer */
+static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
+{
+    VideoState *is = opaque;
+    int audio_size, len1;
+    int64_t start = av_gettime_relative();
+
+    audio_callback_time = clock_time_us();
+
+    if (is->audio_ring.data) {
+        audio_ring_output(is, stream, len);
+        wait_hist_add(&is->audio_callback, av_gettime_relative() - start);
+        return;
+    }
+
+    while (len > 0) {
+        if (is->audio_buf_index >= is->audio_buf_size) {
+           audio_size = audio_decode_frame(is);
+           if (audio_size < 0) {
+                /* if error, just output silence */
+               if (!is->paused)
+                   SDL_AtomicAdd(&is->audio_silence, 1);
+               is->audio_buf = NULL;
+               is->audio_buf_size = SDL_AUDIO_MIN_BUFFER_SIZE / is->audio_tgt.frame_size * is->audio_tgt.frame_size;
+           } else {
+               if (is->show_mode != SHOW_MODE_VIDEO)
+                   update_sample_display(is, (int16_t *)is->audio_buf, audio_size);
+               is->audio_buf_size = audio_size;
+           }
+           is->audio_buf_index = 0;
+        }
+        len1 = is->audio_buf_size - is->audio_buf_index;
+        if (len1 > len)
+            len1 = len;
+        if (!is->muted && is->audio_buf && is->audio_volume == SDL_MIX_MAXVOLUME)
+            memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
+        else {
+            memset(stream, 0, len1);
+            if (!is->muted && is->audio_buf)
+                SDL_MixAudioFormat(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, AUDIO_S16SYS, len1, is->audio_volume);
+        }
+        len -= len1;
+        stream += len1;
+        is->audio_buf_index += len1;
+    }
+    is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
+    /* Let's assume the audio driver that is used by SDL has two periods. */
+    if (!isnan(is->audio_clock)) {
+        set_clock_at(&is->audclk, is->audio_clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial, audio_callback_time / 1000000.0);
+        sync_clock_to_slave(&is->extclk, &is->audclk);
+    }
+    wait_hist_add(&is->audio_callback, av_gettime_relative() - start);
+}
+
+static int audio_open(void *opaque, AVChannelLayout *wanted_channel_layout, int wanted_sample_rate, struct AudioParams *audio_hw_params)
+{
+    SDL_AudioSpec wanted_spec, spec;
+    const char *env;
+    static const int next_nb_channels[] = {0, 0, 1, 6, 2, 6, 4, 6};
+    static const int next_sample_rates[] = {0, 44100, 48000, 96000, 192000};
+    int next_sample_rate_idx = FF_ARRAY_ELEMS(next_sample_rates) - 1;
+    int wanted_nb_channels = wanted_channel_layout->nb_channels;
+
+    env = SDL_getenv("SDL_AUDIO_CHANNELS");
+    if (env) {
+        wanted_nb_channels = atoi(env);
+        av_channel_layout_uninit(wanted_channel_layout);
+        av_channel_layout_default(wanted_channel_layout, wanted_nb_channels);
+    }
+    if (wanted_channel_layout->order != AV_CHANNEL_ORDER_NATIVE) {
+        av_channel_layout_uninit(wanted_channel_layout);
+        av_channel_layout_default(wanted_channel_layout, wanted_nb_channels);
+    }
+    wanted_nb_channels = wanted_channel_layout->nb_channels;
+    wanted_spec.channels = wanted_nb_channels;
+    wanted_spec.freq = wanted_sample_rate;
+    if (wanted_spec.freq <= 0 || wanted_spec.channels <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid sample rate or channel count!\n");
+        return -1;
+    }
+    while (next_sample_rate_idx && next_sample_rates[next_sample_rate_idx] >= wanted_spec.freq)
+        next_sample_rate_idx--;
+    wanted_spec.format = AUDIO_S16SYS;
+    wanted_spec.silence = 0;
+    wanted_spec.samples = FFMAX(SDL_AUDIO_MIN_BUFFER_SIZE, 2 << av_log2(wanted_spec.freq / SDL_AUDIO_MAX_CALLBACKS_PER_SEC));
+    wanted_spec.callback = sdl_audio_callback;
+    wanted_spec.userdata = opaque;
+    while (!bench && !vclock_mode && !(audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE))) {
+        av_log(NULL, AV_LOG_WARNING, "SDL_OpenAudio (%d channels, %d Hz): %s\n",
+               wanted_spec.channels, wanted_spec.freq, SDL_GetError());
+        wanted_spec.channels = next_nb_channels[FFMIN(7, wanted_spec.channels)];
+        if (!wanted_spec.channels) {
+            wanted_spec.freq = next_sample_rates[next_sample_rate_idx--];
+            wanted_spec.channels = wanted_nb_channels;
+            if (!wanted_spec.freq) {
+                av_log(NULL, AV_LOG_ERROR,
+                       "No more combinations to try, audio open failed\n");
+                return -1;
+            }
+        }
+        av_channel_layout_default(wanted_channel_layout, wanted_spec.channels);
+    }
+    if (!bench && !vclock_mode)
+        startup_mark("audio device opened");
+    if (bench || vclock_mode) {
+        /* no device with -bench or -vclock, convert to exactly what was asked for */
+        spec = wanted_spec;
+        spec.size = spec.samples * spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    }
+    if (spec.format != AUDIO_S16SYS) {
+        av_log(NULL, AV_LOG_ERROR,
+               "SDL advised audio format %d is not supported!\n", spec.format);
+        return -1;
+    }
+    if (spec.channels != wanted_spec.channels) {
+        av_channel_layout_uninit(wanted_channel_layout);
+        av_channel_layout_default(wanted_channel_layout, spec.channels);
+        if (wanted_channel_layout->order != AV_CHANNEL_ORDER_NATIVE) {
+            av_log(NULL, AV_LOG_ERROR,
+                   "SDL advised channel count %d is not supported!\n", spec.channels);
+            return -1;
+        }
+    }
+
+    audio_hw_params->fmt = AV_SAMPLE_FMT_S16;
+    audio_hw_params->freq = spec.freq;
+    if (av_channel_layout_copy(&audio_hw_params->ch_layout, wanted_channel_layout) < 0)
+        return -1;
+    audio_hw_params->frame_size = av_samples_get_buffer_size(NULL, audio_hw_params->ch_layout.nb_channels, 1, audio_hw_params->fmt, 1);
+    audio_hw_params->bytes_per_sec = av_samples_get_buffer_size(NULL, audio_hw_params->ch_layout.nb_channels, audio_hw_params->freq, audio_hw_params->fmt, 1);
+    if (audio_hw_params->bytes_per_sec <= 0 || audio_hw_params->frame_size <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "av_samples_get_buffer_size failed\n");
+        return -1;
+    }
+    return spec.size;
+}
+
+/* Decoder threads for -vthreads/-athreads auto: enough for the picture size
+ * and bit depth, but never more than this player's share of the cores. */
+static int auto_decoder_threads(const AVCodecContext *avctx)
+{
+    const AVPixFmtDescriptor *desc;
+    int64_t pixels;
+    int want, players, budget;
+
+    if (avctx->codec_type != AVMEDIA_TYPE_VIDEO)
+        return 1;
+
+    pixels = (int64_t)avctx->width * avctx->height;
+    want = pixels <=  640 *  480 ? 1 :
+           pixels <= 1280 *  720 ? 2 :
+           pixels <= 1920 * 1088 ? 4 :
+           pixels <= 4096 * 2304 ? 8 : MAX_AUTO_THREADS;
+    /* high bit depth and 4:2:2/4:4:4 profiles cost about twice as much per pixel */
+    desc = av_pix_fmt_desc_get(avctx->pix_fmt);
+    if (desc && (desc->comp[0].depth > 8 || !desc->log2_chroma_h))
+        want *= 2;
+
+    /* mosaic inputs are opened one by one, count those still to come */
+    players = FFMAX(SDL_AtomicGet(&nb_players), nb_input_filenames) * FFMAX(host_players, 1);
+    budget = av_cpu_count() / players;
+    return av_clip(FFMIN(want, budget), 1, MAX_AUTO_THREADS);
+}
+
+static const char *thread_type_name(int thread_type)
+{
+    return thread_type & FF_THREAD_FRAME ? "frame" :
+           thread_type & FF_THREAD_SLICE ? "slice" : "none";
+}
+
+/* open a given stream. Return 0 if OK
+ * async: called off the read thread, which already enabled the stream and
+ * owns eof, so both are left alone */
+static int stream_component_open(VideoState *is, int stream_index, int async)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecContext *avctx;
+    const AVCodec *codec;
+    const char *forced_codec_name = NULL;
+    AVDictionary *opts = NULL;
+    const AVDictionaryEntry *t = NULL;
+    int sample_rate;
+    AVChannelLayout ch_layout = { 0 };
+    int ret = 0;
+    int stream_lowres = lowres;
+
+    if (stream_index < 0 || stream_index >= ic->nb_streams)
+        return -1;
+
+    avctx = avcodec_alloc_context3(NULL);
+    if (!avctx)
+        return AVERROR(ENOMEM);
+
+    ret = avcodec_parameters_to_context(avctx, ic->streams[stream_index]->codecpar);
+    if (ret < 0)
+        goto fail;
+    avctx->pkt_timebase = ic->streams[stream_index]->time_base;
+
+    codec = avcodec_find_decoder(avctx->codec_id);
+
+    switch (avctx->codec_type) {
+        case AVMEDIA_TYPE_AUDIO   : is->last_audio_stream    = stream_index; forced_codec_name =    audio_codec_name; break;
+        case AVMEDIA_TYPE_SUBTITLE: is->last_subtitle_stream = stream_index; forced_codec_name = subtitle_codec_name; break;
+        case AVMEDIA_TYPE_VIDEO   : is->last_video_stream    = stream_index; forced_codec_name =    video_codec_name; break;
+        default: break;
+    }
+    if (forced_codec_name)
+        codec = avcodec_find_decoder_by_name(forced_codec_name);
+    if (!codec) {
+        if (forced_codec_name) av_log(NULL, AV_LOG_WARNING,
+                                      "No codec could be found with name '%s'\n", forced_codec_name);
+        else                   av_log(NULL, AV_LOG_WARNING,
+                                      "No decoder could be found for codec %s\n", avcodec_get_name(avctx->codec_id));
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    avctx->codec_id = codec->id;
+    if (stream_lowres > codec->max_lowres) {
+        av_log(avctx, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n",
+                codec->max_lowres);
+        stream_lowres = codec->max_lowres;
+    }
+    avctx->lowres = stream_lowres;
+
+    if (fast)
+        avctx->flags2 |= AV_CODEC_FLAG2_FAST;
+
+    opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
+    /* a generic -threads codec option still takes precedence */
+    if (!av_dict_get(opts, "threads", NULL, 0)) {
+        int threads = avctx->codec_type == AVMEDIA_TYPE_VIDEO ? video_threads :
+                      avctx->codec_type == AVMEDIA_TYPE_AUDIO ? audio_threads : 0;
+        if (threads < 0)
+            threads = auto_decoder_threads(avctx);
+        if (threads)
+            av_dict_set_int(&opts, "threads", threads, 0);
+        else
+            av_dict_set(&opts, "threads", "auto", 0);
+    }
+    if (decoder_thread_type)
+        avctx->thread_type = decoder_thread_type;
+    if (stream_lowres)
+        av_dict_set_int(&opts, "lowres", stream_lowres, 0);
+
+    if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
+        goto fail;
+    }
+    av_log(NULL, AV_LOG_VERBOSE, "%s decoder %s: %d thread(s), %s threading (%d cores, %d player(s))\n",
+           av_get_media_type_string(avctx->codec_type), codec->name, avctx->thread_count,
+           thread_type_name(avctx->active_thread_type), av_cpu_count(),
+           SDL_AtomicGet(&nb_players) * FFMAX(host_players, 1));
+    if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
+        ret =  AVERROR_OPTION_NOT_FOUND;
+        goto fail;
+    }
+
+    if (!async) {
+        is->eof = 0;
+        ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+    }
+    switch (avctx->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        {
+            AVFilterContext *sink;
+
+            is->audio_filter_src.freq           = avctx->sample_rate;
+            ret = av_channel_layout_copy(&is->audio_filter_src.ch_layout, &avctx->ch_layout);
+            if (ret < 0)
+                goto fail;
+            is->audio_filter_src.fmt            = avctx->sample_fmt;
+            if ((ret = configure_audio_filters(is, afilters, 0)) < 0)
+                goto fail;
+            sink = is->out_audio_filter;
+            sample_rate    = av_buffersink_get_sample_rate(sink);
+            ret = av_buffersink_get_ch_layout(sink, &ch_layout);
+            if (ret < 0)
+                goto fail;
+        }
+
+        /* prepare audio output */
+        if ((ret = audio_open(is, &ch_layout, sample_rate, &is->audio_tgt)) < 0)
+            goto fail;
+        is->audio_hw_buf_size = ret;
+        is->audio_src = is->audio_tgt;
+        is->audio_buf_size  = 0;
+        is->audio_buf_index = 0;
+
+        /* init averaging filter */
+        is->audio_diff_avg_coef  = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+        is->audio_diff_avg_count = 0;
+        /* since we do not have a precise anough audio FIFO fullness,
+           we correct audio sync only if larger than this threshold */
+        is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
+
+        is->audio_stream = stream_index;
+        is->audio_st = ic->streams[stream_index];
+
+        if ((ret = decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread)) < 0)
+            goto fail;
+        if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
+            is->auddec.start_pts = is->audio_st->start_time;
+            is->auddec.start_pts_tb = is->audio_st->time_base;
+        }
+        if ((ret = decoder_start(&is->auddec, audio_thread, "audio_decoder", is)) < 0)
+            goto out;
+        if (audio_dev) {
+            if ((ret = audio_mixer_start(is)) < 0)
+                goto out;
+            SDL_PauseAudioDevice(audio_dev, 0);
+        }
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        is->video_stream = stream_index;
+        is->video_st = ic->streams[stream_index];
+        is->skip_frame_base = avctx->skip_frame;
+        is->predrop_level = 0;
+        is->predrop_load = 0;
+        is->predrop_last_pts = NAN;
+
+        if ((ret = decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread)) < 0)
+            goto fail;
+        if ((ret = decoder_start(&is->viddec, video_thread, "video_decoder", is)) < 0)
+            goto out;
+        is->queue_attachments_req = 1;
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        is->subtitle_stream = stream_index;
+        is->subtitle_st = ic->streams[stream_index];
+
+        if ((ret = decoder_init(&is->subdec, avctx, &is->subtitileq, is->continue_read_thread)) < 0)
+            goto fail;
+        if ((ret = decoder_start(&is->subdec, subtitle_thread, "subtitle_decoder", is)) < 0)
+            goto out;
+        break;
+    default:
+        break;
+    }
+    goto out;
+
+fail:
+    avcodec_free_context(&avctx);
+out:
+    av_channel_layout_uninit(&ch_layout);
+    av_dict_free(&opts);
+
+    return ret;
+}
+
+static void stream_component_close(VideoState *is, int stream_index)
+{
+    AVFormatContext *ic = is->ic;
+    AVCodecParameters *codecpar;
+
+    if (stream_index < 0 || stream_index >= ic->nb_streams)
+        return;
+    codecpar = ic->streams[stream_index]->codecpar;
+
+    switch (codecpar->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        decoder_abort(&is->auddec, &is->sampq);
+        audio_mixer_stop(is);
+        if (audio_dev)
+            SDL_CloseAudioDevice(audio_dev);
+        audio_ring_free(&is->audio_ring);
+        decoder_destroy(&is->auddec);
+        swr_free(&is->swr_ctx);
+        av_freep(&is->audio_buf1);
+        is->audio_buf1_size = 0;
+        is->audio_buf = NULL;
+
+        av_tx_uninit(&is->rdft);
+        av_freep(&is->real_data);
+        av_freep(&is->rdft_data);
+        av_freep(&is->rdft_window);
+        av_freep(&is->vis_column);
+        av_freep(&is->vis_rects);
+        is->vis_rects_size = 0;
+        av_freep(&is->vclock_audio_buf);
+        is->vclock_audio_buf_size = 0;
+        is->vclock_audio_start = 0;
+        is->rdft_bits = 0;
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        decoder_abort(&is->viddec, &is->pictq);
+        decoder_destroy(&is->viddec);
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        decoder_abort(&is->subdec, &is->subq);
+        decoder_destroy(&is->subdec);
+        break;
+    default:
+        break;
+    }
+
+    ic->streams[stream_index]->discard = AVDISCARD_ALL;
+    switch (codecpar->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        is->audio_st = NULL;
+        is->audio_stream = -1;
+        break;
+    case AVMEDIA_TYPE_VIDEO:
+        is->video_st = NULL;
+        is->video_stream = -1;
+        break;
+    case AVMEDIA_TYPE_SUBTITLE:
+        is->subtitle_st = NULL;
+        is->subtitle_stream = -1;
+        break;
+    default:
+        break;
+    }
+}
+
+/* path of filename on the local file system, NULL for any other protocol */
+static const char *local_file_path(const char *filename)
+{
+    const char *proto = avio_find_protocol_name(filename);
+    const char *path = filename;
+
+    if (!proto || strcmp(proto, "file"))
+        return NULL;
+    av_strstart(filename, "file:", &path);
+    return path;
+}
+
+static int local_file_stat(const char *path, int64_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path, &st) < 0)
+        return AVERROR(errno);
+#else
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return AVERROR(errno);
+#endif
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+/* read-only mapping of a whole regular file */
+static void *map_file(const char *path, size_t *size)
+{
+    void *map = NULL;
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER file_size;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart <= SIZE_MAX) {
+        if ((mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+            map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = file_size.QuadPart;
+    }
+    CloseHandle(file);
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= SIZE_MAX) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+#endif
+    return map;
+}
+
+static void unmap_file(void *map, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(map);
+#else
+    munmap(map, size);
+#endif
+}
+
+static int mapped_file_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MappedFile *m = opaque;
+    int size = FFMIN(buf_size, m->size - m->pos);
+
+    if (size <= 0)
+        return AVERROR_EOF;
+#ifndef _WIN32
+    /* keep the kernel paging in ahead of the demuxer, from wherever it reads now */
+    if (m->pos + size + MAPPED_IO_READAHEAD / 2 > m->advised && m->advised < m->size) {
+        int64_t start = m->pos & ~(int64_t)(m->page_size - 1);
+        int64_t end = FFMIN(m->pos + MAPPED_IO_READAHEAD, m->size);
+        madvise((void *)(m->data + start), end - start, MADV_WILLNEED);
+        m->advised = end;
+    }
+#endif
+    memcpy(buf, m->data + m->pos, size);
+    m->pos += size;
+    return size;
+}
+
+static int64_t mapped_file_seek(void *opaque, int64_t offset, int whence)
+{
+    MappedFile *m = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return m->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = m->pos + offset;
+        break;
+    case SEEK_END:
+        pos = m->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > m->size)
+        return AVERROR(EINVAL);
+    /* a jump restarts the read-ahead window at the new position */
+    if (pos < m->pos || pos > m->advised)
+        m->advised = pos;
+    m->pos = pos;
+    return pos;
+}
+
+/* map path and wrap it in an AVIOContext for the demuxer, for -io mmap */
+static int mapped_file_open(VideoState *is, const char *path)
+{
+    MappedFile *m;
+    uint8_t *buffer;
+    size_t size;
+    void *map;
+
+    if (!(map = map_file(path, &size)))
+        return AVERROR(EINVAL);
+    m = av_mallocz(sizeof(*m));
+    buffer = av_malloc(MAPPED_IO_BUFFER_SIZE);
+    if (!m || !buffer)
+        goto fail;
+    m->data = map;
+    m->size = size;
+#ifndef _WIN32
+    m->page_size = sysconf(_SC_PAGESIZE);
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+    if (!(is->mapped_pb = avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, m, mapped_file_read, NULL, mapped_file_seek)))
+        goto fail;
+    is->mapped_file = m;
+    return 0;
+
+fail:
+    av_free(buffer);
+    av_free(m);
+    unmap_file(map, size);
+    return AVERROR(ENOMEM);
+}
+
+static void mapped_file_close(VideoState *is)
+{
+    if (is->mapped_pb) {
+        av_freep(&is->mapped_pb->buffer);
+        avio_context_free(&is->mapped_pb);
+    }
+    if (is->mapped_file) {
+        unmap_file((void *)is->mapped_file->data, is->mapped_file->size);
+        av_freep(&is->mapped_file);
+    }
+}
+
+static void kf_index_close(KeyframeIndex **pidx)
+{
+    if (!*pidx)
+        return;
+    unmap_file((*pidx)->map, (*pidx)->map_size);
+    av_freep(pidx);
+}
+
+/* map the sidecar of a local file, fails if it is missing or was made for another version of the file */
+static int kf_index_open(const char *path, KeyframeIndex **pidx)
+{
+    const KeyframeIndexHeader *hdr;
+    KeyframeIndex *idx;
+    char *sidecar;
+    int64_t size, mtime;
+    size_t map_size = 0;
+    void *map;
+    int ret;
+
+    if ((ret = local_file_stat(path, &size, &mtime)) < 0)
+        return ret;
+    if (!(sidecar = av_asprintf("%s" KFIDX_SUFFIX, path)))
+        return AVERROR(ENOMEM);
+    map = map_file(sidecar, &map_size);
+    av_free(sidecar);
+    if (!map)
+        return AVERROR(ENOENT);
+
+    hdr = map;
+    if (map_size < sizeof(*hdr) || memcmp(hdr->magic, KFIDX_MAGIC, sizeof(hdr->magic)) ||
+        hdr->file_size != size || hdr->file_mtime != mtime ||
+        hdr->nb_entries <= 0 || hdr->nb_entries > INT_MAX ||
+        map_size != sizeof(*hdr) + hdr->nb_entries * sizeof(KeyframeIndexEntry)) {
+        unmap_file(map, map_size);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (!(idx = av_mallocz(sizeof(*idx)))) {
+        unmap_file(map, map_size);
+        return AVERROR(ENOMEM);
+    }
+    idx->map = map;
+    idx->map_size = map_size;
+    idx->entries = (const KeyframeIndexEntry *)(hdr + 1);
+    idx->nb_entries = hdr->nb_entries;
+    *pidx = idx;
+    return 0;
+}
+
+/* keyframe to start from for a seek to ts, restricted to [min_ts, max_ts] */
+static const KeyframeIndexEntry *kf_index_find(const KeyframeIndex *idx, int64_t min_ts, int64_t ts, int64_t max_ts)
+{
+    int lo = 0, hi = idx->nb_entries - 1, i = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        if (idx->entries[mid].pts <= ts) {
+            i = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    /* a forward seek must not land before min_ts, take the next keyframe instead */
+    if (i < 0 || idx->entries[i].pts < min_ts)
+        i++;
+    if (i >= idx->nb_entries || idx->entries[i].pts < min_ts || idx->entries[i].pts > max_ts)
+        return NULL;
+    return &idx->entries[i];
+}
+
+/* last keyframe at or before the byte offset pos */
+static const KeyframeIndexEntry *kf_index_find_pos(const KeyframeIndex *idx, int64_t pos)
+{
+    int lo = 0, hi = idx->nb_entries - 1, i = 0;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        if (idx->entries[mid].pos <= pos) {
+            i = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &idx->entries[i];
+}
+
+static int decode_interrupt_cb(void *ctx)
+{
+    VideoState *is = ctx;
+    return is->abort_request;
+}
+
+static Thumbnail *thumb_find(ThumbEngine *e, int slot)
+{
+    int i;
+
+    for (i = 0; i < THUMB_CACHE_SIZE; i++)
+        if (e->thumbs[i].slot == slot)
+            return &e->thumbs[i];
+    return NULL;
+}
+
+/* the cached thumbnail closest to slot */
+static Thumbnail *thumb_find_nearest(ThumbEngine *e, int slot)
+{
+    Thumbnail *best = NULL;
+    int i;
+
+    for (i = 0; i < THUMB_CACHE_SIZE; i++) {
+        Thumbnail *t = &e->thumbs[i];
+
+        if (t->slot >= 0 && (!best || abs(t->slot - slot) < abs(best->slot - slot)))
+            best = t;
+    }
+    return best;
+}
+
+/* The position the display asks for, otherwise the next one to prefetch.
+ * Prefetching goes through the slots in bit-reversed order, which covers
+ * the whole duration coarsely first and then refines it. */
+static int thumb_next_slot(ThumbEngine *e)
+{
+    if (e->want_slot >= 0 && !e->failed[e->want_slot] && !thumb_find(e, e->want_slot))
+        return e->want_slot;
+    while (e->nb_prefetched < THUMB_CACHE_SIZE) {
+        int i = e->nb_prefetched++, slot = 0, bit;
+
+        for (bit = 1; bit < THUMB_SLOTS; bit <<= 1)
+            slot = slot << 1 | !!(i & bit);
+        if (!e->failed[slot] && !thumb_find(e, slot))
+            return slot;
+    }
+    return -1;
+}
+
+/* decode the keyframe at or before ts, in AV_TIME_BASE */
+static int thumb_decode(AVFormatContext *ic, AVCodecContext *avctx, int index, int64_t ts, AVPacket *pkt, AVFrame *frame)
+{
+    int ret, nb_pkts = 0;
+
+    if ((ret = avformat_seek_file(ic, -1, INT64_MIN, ts, ts, 0)) < 0)
+        return ret;
+    avcodec_flush_buffers(avctx);
+    for (;;) {
+        ret = avcodec_receive_frame(avctx, frame);
+        if (ret != AVERROR(EAGAIN))
+            return ret;
+        if (nb_pkts >= THUMB_MAX_PACKETS)
+            return AVERROR(EAGAIN);
+        ret = av_read_frame(ic, pkt);
+        if (ret == AVERROR_EOF) {
+            /* drain once, the next receive returns a frame or EOF */
+            if ((ret = avcodec_send_packet(avctx, NULL)) < 0)
+                return ret;
+            continue;
+        }
+        if (ret < 0)
+            return ret;
+        if (pkt->stream_index == index) {
+            nb_pkts++;
+            ret = avcodec_send_packet(avctx, pkt);
+        }
+        av_packet_unref(pkt);
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_INVALIDDATA)
+            return ret;
+    }
+}
+
+static int thumb_store(ThumbEngine *e, int slot, AVFrame *frame, struct SwsContext **sws)
+{
+    AVRational sar = frame->sample_aspect_ratio;
+    uint8_t *pixels, *dst[4] = { NULL };
+    int dst_linesize[4] = { 0 };
+    Thumbnail *t;
+    int w = THUMB_WIDTH, h, i;
+
+    if (!sar.num || !sar.den)
+        sar = (AVRational){ 1, 1 };
+    h = av_clip(av_rescale(w, (int64_t)frame->height * sar.den, (int64_t)frame->width * sar.num), 1, 2 * THUMB_WIDTH);
+    *sws = sws_getCachedContext(*sws, frame->width, frame->height, frame->format,
+                                w, h, AV_PIX_FMT_BGRA, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!*sws)
+        return AVERROR(EINVAL);
+    if (!(pixels = av_malloc(w * h * 4)))
+        return AVERROR(ENOMEM);
+    dst[0] = pixels;
+    dst_linesize[0] = w * 4;
+    sws_scale(*sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, dst, dst_linesize);
+
+    SDL_LockMutex(e->mutex);
+    t = &e->thumbs[0];
+    for (i = 0; i < THUMB_CACHE_SIZE; i++) {
+        if (e->thumbs[i].slot < 0) {
+            t = &e->thumbs[i];
+            break;
+        }
+        if (e->thumbs[i].last_used < t->last_used)
+            t = &e->thumbs[i];
+    }
+    av_free(t->pixels);
+    t->slot = slot;
+    t->width = w;
+    t->height = h;
+    t->pixels = pixels;
+    t->last_used = ++e->uses;
+    SDL_UnlockMutex(e->mutex);
+    return 0;
+}
+
+/* sleep in proportion to the time just spent decoding, so that the
+ * previews use no more than -thumbs_cpu percent of one core */
+static void thumb_throttle(VideoState *is, ThumbEngine *e, int64_t busy)
+{
+    int share = av_clip(thumbs_cpu, 1, 100);
+    int64_t until = av_gettime_relative() + busy * (100 - share) / share;
+    int64_t now;
+
+    SDL_LockMutex(e->mutex);
+    while (!is->abort_request && (now = av_gettime_relative()) < until)
+        SDL_CondWaitTimeout(e->cond, e->mutex, (until - now + 999) / 1000);
+    SDL_UnlockMutex(e->mutex);
+}
+
+static int thumb_thread(void *arg)
+{
+    VideoState *is = arg;
+    ThumbEngine *e = is->thumbs;
+    AVFormatContext *ic = avformat_alloc_context();
+    AVCodecContext *avctx = NULL;
+    const AVCodec *codec = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    struct SwsContext *sws = NULL;
+    int index, i, ret;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    if (!ic || !pkt || !frame)
+        goto end;
+    ic->interrupt_callback.callback = decode_interrupt_cb;
+    ic->interrupt_callback.opaque = is;
+    if (avformat_open_input(&ic, is->filename, is->iformat, NULL) < 0 ||
+        avformat_find_stream_info(ic, NULL) < 0 || ic->duration <= 0)
+        goto end;
+    if ((index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0)
+        goto end;
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    if (!(avctx = avcodec_alloc_context3(codec)) ||
+        avcodec_parameters_to_context(avctx, ic->streams[index]->codecpar) < 0)
+        goto end;
+    avctx->lowres = FFMIN(codec->max_lowres, FFMAX(lowres, THUMB_LOWRES));
+    avctx->skip_frame = AVDISCARD_NONKEY;
+    avctx->thread_count = 1;
+    if (avcodec_open2(avctx, codec, NULL) < 0)
+        goto end;
+
+    while (!is->abort_request) {
+        int64_t start, ts;
+        int slot;
+
+        SDL_LockMutex(e->mutex);
+        if ((slot = thumb_next_slot(e)) < 0) {
+            SDL_CondWaitTimeout(e->cond, e->mutex, 100);
+            SDL_UnlockMutex(e->mutex);
+            continue;
+        }
+        SDL_UnlockMutex(e->mutex);
+
+        start = av_gettime_relative();
+        ts = av_rescale(ic->duration, slot, THUMB_SLOTS);
+        if (ic->start_time != AV_NOPTS_VALUE)
+            ts += ic->start_time;
+        ret = thumb_decode(ic, avctx, index, ts, pkt, frame);
+        if (ret >= 0)
+            ret = thumb_store(e, slot, frame, &sws);
+        av_frame_unref(frame);
+        if (ret < 0) {
+            if (is->abort_request)
+                break;
+            e->failed[slot] = 1;
+        } else if (slot == e->want_slot) {
+            is->force_refresh = 1;
+            refresh_loop_wake(is);
+        }
+        thumb_throttle(is, e, av_gettime_relative() - start);
+    }
+
+end:
+    sws_freeContext(sws);
+    avcodec_free_context(&avctx);
+    avformat_close_input(&ic);
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    return 0;
+}
+
+static void thumb_engine_free(ThumbEngine **pe)
+{
+    ThumbEngine *e = *pe;
+    int i;
+
+    if (!e)
+        return;
+    for (i = 0; i < THUMB_CACHE_SIZE; i++)
+        av_free(e->thumbs[i].pixels);
+    SDL_DestroyCond(e->cond);
+    SDL_DestroyMutex(e->mutex);
+    av_freep(pe);
+}
+
+static void thumb_engine_start(VideoState *is)
+{
+    ThumbEngine *e = av_mallocz(sizeof(*e));
+    int i;
+
+    if (!e)
+        return;
+    e->mutex = SDL_CreateMutex();
+    e->cond = SDL_CreateCond();
+    e->want_slot = -1;
+    for (i = 0; i < THUMB_CACHE_SIZE; i++)
+        e->thumbs[i].slot = -1;
+    if (!e->mutex || !e->cond) {
+        thumb_engine_free(&e);
+        return;
+    }
+    SDL_AtomicSetPtr((void **)&is->thumbs, e);
+    if (!(e->tid = SDL_CreateThread(thumb_thread, "thumbs", is))) {
+        av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+        SDL_AtomicSetPtr((void **)&is->thumbs, NULL);
+        thumb_engine_free(&e);
+    }
+}
+
+static void thumb_engine_stop(VideoState *is)
+{
+    ThumbEngine *e = is->thumbs;
+
+    if (!e)
+        return;
+    SDL_LockMutex(e->mutex);
+    SDL_CondSignal(e->cond);
+    SDL_UnlockMutex(e->mutex);
+    SDL_WaitThread(e->tid, NULL);
+    thumb_engine_free(&is->thumbs);
+}
+
+static void stream_close(VideoState *is)
+{
+    int i;
+
+    /* XXX: use a special url_shutdown call to abort parse cleanly */
+    is->abort_request = 1;
+    SDL_AtomicAdd(&nb_players, -1);
+    for (i = 0; i < nb_videostates; i++) {
+        if (videostates[i] == is) {
+            memmove(&videostates[i], &videostates[i + 1], (nb_videostates - i - 1) * sizeof(*videostates));
+            nb_videostates--;
+            break;
+        }
+    }
+    if (is->continue_read_mutex)
+        wake_read_thread(is);
+    SDL_WaitThread(is->read_tid, NULL);
+    SDL_WaitThread(is->index_tid, NULL);
+    thumb_engine_stop(is);
+    SDL_WaitThread(is->audio_open_tid, NULL);
+
+    /* close each stream */
+    if (is->audio_stream >= 0)
+        stream_component_close(is, is->audio_stream);
+    if (is->video_stream >= 0)
+        stream_component_close(is, is->video_stream);
+    if (is->subtitle_stream >= 0)
+        stream_component_close(is, is->subtitle_stream);
+
+    avformat_close_input(&is->ic);
+    mapped_file_close(is);
+
+    pakcet_queue_destroy(&is->videoq);
+    pakcet_queue_destroy(&is->audioq);
+    pakcet_queue_destroy(&is->subtitileq);
+
+    /* free all pictures */
+    frame_queue_destroy(&is->pictq);
+    frame_queue_destroy(&is->sampq);
+    frame_queue_destroy(&is->subq);
+    SDL_DestroyCond(is->continue_read_thread);
+    SDL_DestroyMutex(is->continue_read_mutex);
+    sws_freeContext(is->img_convert_ctx);
+    sws_freeContext(is->sub_convert_ctx);
+    scale_job_free(scale_pool, &is->scale_job);
+    av_free(is->filename);
+    kf_index_close(&is->kf_index);
+    if (is->vis_texture)
+        SDL_DestroyTexture(is->vis_texture);
+    if (is->vid_texture)
+        SDL_DestroyTexture(is->vid_texture);
+    if (is->sub_texture)
+        SDL_DestroyTexture(is->sub_texture);
+    if (is->thumb_texture)
+        SDL_DestroyTexture(is->thumb_texture);
+    av_free(is);
+}
+
+static void wait_stats_print(AVBPrint *bp, VideoState *is)
+{
+    const struct {
+        const char *name;
+        WaitHistogram *h;
+    } hists[] = {
+        { "videoq.get",          &is->videoq.get_wait },
+        { "audioq.get",          &is->audioq.get_wait },
+        { "subtitleq.get",       &is->subtitileq.get_wait },
+        { "pictq.peek_writable", &is->pictq.write_wait },
+        { "pictq.peek_readable", &is->pictq.read_wait },
+        { "sampq.peek_writable", &is->sampq.write_wait },
+        { "sampq.peek_readable", &is->sampq.read_wait },
+        { "subq.peek_writable",  &is->subq.write_wait },
+        { "subq.peek_readable",  &is->subq.read_wait },
+        { "audio_callback",      &is->audio_callback },
+    };
+    int i, j;
+
+    av_bprintf(bp, "{\n  \"unit\": \"us\",\n  \"audio_silence\": %d,\n  \"audio_underruns\": %d,\n  \"histograms\": {\n",
+               SDL_AtomicGet(&is->audio_silence), SDL_AtomicGet(&is->audio_underruns));
+    for (i = 0; i < FF_ARRAY_ELEMS(hists); i++) {
+        int buckets[WAIT_HIST_BUCKETS];
+        int count = 0;
+
+        /* snapshot, the owning threads keep counting meanwhile */
+        for (j = 0; j < WAIT_HIST_BUCKETS; j++) {
+            buckets[j] = SDL_AtomicGet(&hists[i].h->buckets[j]);
+            count += buckets[j];
+        }
+        av_bprintf(bp, "    \"%s\": { \"count\": %d, \"max\": %d, \"p50\": %"PRId64", \"p99\": %"PRId64", \"buckets\": [",
+                   hists[i].name, count, SDL_AtomicGet(&hists[i].h->max),
+                   wait_hist_quantile(buckets, count, 0.50), wait_hist_quantile(buckets, count, 0.99));
+        for (j = 0; j < WAIT_HIST_BUCKETS; j++)
+            av_bprintf(bp, "%s%d", j ? ", " : "", buckets[j]);
+        av_bprintf(bp, "] }%s\n", i < FF_ARRAY_ELEMS(hists) - 1 ? "," : "");
+    }
+    av_bprintf(bp, "  }\n}");
+}
+
+/* write the wait histograms as JSON, to stderr when no file is given; an
+ * array of them with one entry per player under -mosaic */
+static void wait_stats_dump(VideoState **players, int nb, const char *filename)
+{
+    AVBPrint bp;
+    FILE *f = stderr;
+    int i;
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    if (nb > 1)
+        av_bprintf(&bp, "[\n");
+    for (i = 0; i < nb; i++) {
+        wait_stats_print(&bp, players[i]);
+        av_bprintf(&bp, "%s\n", i < nb - 1 ? "," : "");
+    }
+    if (nb > 1)
+        av_bprintf(&bp, "]\n");
+
+    if (filename && !strcmp(filename, "-"))
+        f = stdout;
+    else if (filename && !(f = fopen(filename, "w")))
+        av_log(NULL, AV_LOG_ERROR, "Could not open %s: %s\n", filename, strerror(errno));
+    if (f) {
+        fputs(bp.str, f);
+        if (f == stdout || f == stderr)
+            fflush(f);
+        else
+            fclose(f);
+    }
+    av_bprint_finalize(&bp, NULL);
+}
+
+static void do_exit(VideoState *is)
+{
+    /* release video threads still waiting for the renderer, stream_close() joins them */
+    if (display_mutex)
+            set_display_ready();
+    if (startup_trace && !SDL_AtomicGet(&startup_reported))
+        startup_report("exit, no frame was presented");
+    if (is) {
+            if (vclock_mode)
+                av_log(NULL, AV_LOG_INFO, "vclock: %.3f s of playback in %.3f s\n",
+                       (clock_time_us() - AV_TIME_BASE) / 1000000.0,
+                       (av_gettime_relative() - startup_time) / 1000000.0);
+            if (wait_stats_file)
+                wait_stats_dump(videostates, nb_videostates, wait_stats_file);
+    }
+    while (nb_videostates)
+            stream_close(videostates[nb_videostates - 1]);
+    scale_pool_free(&scale_pool);
+    if (renderer)
+            SDL_DestroyRenderer(renderer);
+    if (window)
+            SDL_DestroyWindow(window);
+    uninit_opts();
+    av_freep(&vfilters_list);
+    avformat_network_deinit();
+    if (show_status)
+            printf("\n");
+    SDL_Quit();
+    av_log(NULL, AV_LOG_QUIET, "%s", "");
+    exit(0);
+}
+
+/* Demux the whole file and write the keyframes of its video stream (or of
+ * its audio stream when there is no video) to the sidecar. is may be NULL,
+ * otherwise its abort_request interrupts the scan. */
+static int kf_index_build(const char *filename, const AVInputFormat *iformat, VideoState *is)
+{
+    const char *path = local_file_path(filename);
+    KeyframeIndexHeader hdr = { { 0 } };
+    KeyframeIndexEntry *entries = NULL;
+    unsigned int entries_size = 0;
+    int nb_entries = 0;
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    AVStream *st;
+    char *sidecar = NULL, *tmp = NULL;
+    FILE *f;
+    int index, i, ret;
+
+    if (!path) {
+        av_log(NULL, AV_LOG_ERROR, "%s: keyframe indexes are only kept for local files\n", filename);
+        return AVERROR(ENOSYS);
+    }
+    memcpy(hdr.magic, KFIDX_MAGIC, sizeof(hdr.magic));
+    if ((ret = local_file_stat(path, &hdr.file_size, &hdr.file_mtime)) < 0)
+        return ret;
+
+    pkt = av_packet_alloc();
+    ic = avformat_alloc_context();
+    if (!pkt || !ic) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (is) {
+        ic->interrupt_callback.callback = decode_interrupt_cb;
+        ic->interrupt_callback.opaque = is;
+    }
+    if ((ret = avformat_open_input(&ic, filename, iformat, NULL)) < 0)
+        goto end;
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+        goto end;
+
+    index = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (index < 0)
+        index = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (index < 0) {
+        ret = index;
+        goto end;
+    }
+    for (i = 0; i < ic->nb_streams; i++)
+        ic->streams[i]->discard = i == index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    st = ic->streams[index];
+
+    while ((ret = av_read_frame(ic, pkt)) >= 0) {
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+        if (pkt->stream_index == index && (pkt->flags & AV_PKT_FLAG_KEY) &&
+            ts != AV_NOPTS_VALUE && pkt->pos >= 0) {
+            KeyframeIndexEntry *last = nb_entries ? &entries[nb_entries - 1] : NULL;
+
+            ts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+            if (last && ts < last->pts) {
+                av_log(NULL, AV_LOG_WARNING, "%s: timestamps go backwards at byte %"PRId64", not indexing\n",
+                       filename, pkt->pos);
+                ret = AVERROR_INVALIDDATA;
+                goto end;
+            }
+            if (!last || (ts - last->pts >= KFIDX_MIN_SPACING && pkt->pos > last->pos)) {
+                KeyframeIndexEntry *e = av_fast_realloc(entries, &entries_size, (nb_entries + 1) * sizeof(*entries));
+                if (!e) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+                entries = e;
+                entries[nb_entries].pts = ts;
+                entries[nb_entries].pos = pkt->pos;
+                nb_entries++;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+    if (!nb_entries) {
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    hdr.nb_entries = nb_entries;
+
+    /* write to a temporary file so that a reader never maps a partial index */
+    sidecar = av_asprintf("%s" KFIDX_SUFFIX, path);
+    tmp = av_asprintf("%s" KFIDX_SUFFIX ".tmp", path);
+    if (!sidecar || !tmp) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (!(f = fopen(tmp, "wb"))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    ret = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+          fwrite(entries, sizeof(*entries), nb_entries, f) == nb_entries;
+    if (fclose(f) || !ret) {
+        remove(tmp);
+        ret = AVERROR(EIO);
+        goto end;
+    }
+#ifdef _WIN32
+    remove(sidecar);
+#endif
+    if (rename(tmp, sidecar) < 0) {
+        ret = AVERROR(errno);
+        remove(tmp);
+        goto end;
+    }
+    av_log(NULL, AV_LOG_INFO, "%s: indexed %d keyframes of stream %d\n", sidecar, nb_entries, index);
+    ret = 0;
+
+end:
+    av_packet_free(&pkt);
+    avformat_close_input(&ic);
+    av_free(entries);
+    av_free(sidecar);
+    av_free(tmp);
+    return ret;
+}
+
+/* builds the missing index while the file plays and hands it to the read thread */
+static int index_thread(void *arg)
+{
+    VideoState *is = arg;
+    KeyframeIndex *idx = NULL;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    if (kf_index_build(is->filename, is->iformat, is) >= 0 &&
+        kf_index_open(local_file_path(is->filename), &idx) >= 0)
+        SDL_AtomicSetPtr((void **)&is->kf_index, idx);
+    return 0;
+}
+
+static int is_realtime(AVFormatContext *s)
+{
+    if (   !strcmp(s->iformat->name, "rtp")
+        || !strcmp(s->iformat->name, "rtsp")
+        || !strcmp(s->iformat->name, "sdp")
+    )
+        return 1;
+
+    if (s->pb && (   !strncmp(s->url, "rtp:", 4)
+                  || !strncmp(s->url, "udp:", 4)
+                 )
+    )
+        return 1;
+    return 0;
+}
+
+static int stream_has_enough_packets(AVStream *st, int stream_id, PacketQueue *queue, double target)
+{
+    if (stream_id < 0 || queue->abort_request ||
+        (st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+        return 1;
+    /* without packet durations from the demuxer fall back to a packet count */
+    if (!queue->duration)
+        return queue->nb_packets > MIN_FRAMES;
+    return queue->duration * av_q2d(st->time_base) >= target;
+}
+
+/* over -max_mem, but never while a decoder has no packet left, the
+ * frames that hold the budget can only be released by decoding on */
+static int read_mem_over(VideoState *is)
+{
+    if (!queued_mem_over())
+        return 0;
+    if (is->audio_stream >= 0 && !is->audioq.nb_packets)
+        return 0;
+    if (is->video_stream >= 0 && !is->videoq.nb_packets &&
+        !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+        return 0;
+    return 1;
+}
+
+static int readahead_queues_full(VideoState *is)
+{
+    return stream_has_enough_packets(is->audio_st, is->audio_stream, &is->audioq, is->readahead_target) &&
+           stream_has_enough_packets(is->video_st, is->video_stream, &is->videoq, is->readahead_target) &&
+           stream_has_enough_packets(is->subtitle_st, is->subtitle_stream, &is->subtitileq, is->readahead_target);
+}
+
+static void readahead_set_refill(AVStream *st, PacketQueue *queue, double target)
+{
+    if (st)
+        queue->refill_duration = target / 2 / av_q2d(st->time_base);
+}
+
+static void readahead_reset(VideoState *is)
+{
+    is->readahead_last_adjust = av_gettime_relative();
+    is->readahead_underruns = is->audioq.nb_underruns + is->videoq.nb_underruns;
+}
+
+/* Grow the read-ahead target while the decoders keep finding their queues
+ * empty, shrink it while the queued packets use more than -readahead_mem.
+ * Returns 1 when memory is tight and no more packets should be read. */
+static int readahead_update(VideoState *is)
+{
+    int64_t now = av_gettime_relative();
+    int64_t total_size = (int64_t)is->audioq.size + is->videoq.size + is->subtitileq.size;
+    int mem_tight = total_size > (int64_t)readahead_max_mem * 1024 * 1024;
+    int underruns = is->audioq.nb_underruns + is->videoq.nb_underruns;
+    double target = is->readahead_target;
+
+    if (now - is->readahead_last_adjust >= READAHEAD_ADJUST_INTERVAL) {
+        if (mem_tight)
+            target = FFMAX(target * 0.5, READAHEAD_MIN);
+        else if (underruns != is->readahead_underruns && !is->eof && !is->paused)
+            target = FFMIN(target * 1.5, FFMAX(readahead_max_duration, READAHEAD_MIN));
+        if (target != is->readahead_target)
+            av_log(NULL, AV_LOG_VERBOSE, "read-ahead target %.2fs -> %.2fs (%"PRId64" KB queued)\n",
+                   is->readahead_target, target, total_size / 1024);
+        is->readahead_target = target;
+        is->readahead_last_adjust = now;
+        is->readahead_underruns = underruns;
+    }
+
+    readahead_set_refill(is->audio_st, &is->audioq, is->readahead_target);
+    readahead_set_refill(is->video_st, &is->videoq, is->readahead_target);
+    readahead_set_refill(is->subtitle_st, &is->subtitileq, is->readahead_target);
+    return mem_tight;
+}
+
+static char *probe_cache_file(const char *path)
+{
+    uint8_t md5[16];
+    char name[33];
+    int i;
+
+    av_md5_sum(md5, (const uint8_t *)path, strlen(path));
+    for (i = 0; i < 16; i++)
+        snprintf(name + 2 * i, 3, "%02x", md5[i]);
+    return av_asprintf("%s/%s.probe", probe_cache_dir, name);
+}
+
+/* the header a cache entry for path must have to be valid */
+static int probe_cache_key(const char *path, ProbeCacheHeader *hdr)
+{
+    uint8_t *head;
+    size_t size;
+    FILE *f;
+    int ret;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, PROBE_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->lavf_version = LIBAVFORMAT_VERSION_INT;
+    hdr->lavc_version = LIBAVCODEC_VERSION_INT;
+    hdr->path_size = strlen(path);
+    if ((ret = local_file_stat(path, &hdr->file_size, &hdr->file_mtime)) < 0)
+        return ret;
+
+    if (!(f = fopen(path, "rb")))
+        return AVERROR(errno);
+    if (!(head = av_malloc(PROBE_CACHE_HEAD_SIZE))) {
+        fclose(f);
+        return AVERROR(ENOMEM);
+    }
+    size = fread(head, 1, PROBE_CACHE_HEAD_SIZE, f);
+    fclose(f);
+    hdr->head_crc = av_crc(av_crc_get_table(AV_CRC_32_IEEE_LE), 0, head, size);
+    av_free(head);
+    return 0;
+}
+
+static void probe_cache_store_stream(ProbeCacheStream *cs, const AVStream *st)
+{
+    const AVCodecParameters *par = st->codecpar;
+
+    memset(cs, 0, sizeof(*cs));
+    cs->id                    = st->id;
+    cs->codec_type            = par->codec_type;
+    cs->codec_id              = par->codec_id;
+    cs->codec_tag             = par->codec_tag;
+    cs->extradata_size        = par->extradata ? par->extradata_size : 0;
+    cs->format                = par->format;
+    cs->bit_rate              = par->bit_rate;
+    cs->bits_per_coded_sample = par->bits_per_coded_sample;
+    cs->bits_per_raw_sample   = par->bits_per_raw_sample;
+    cs->profile               = par->profile;
+    cs->level                 = par->level;
+    cs->width                 = par->width;
+    cs->height                = par->height;
+    cs->sample_aspect_ratio   = par->sample_aspect_ratio;
+    cs->field_order           = par->field_order;
+    cs->color_range           = par->color_range;
+    cs->color_primaries       = par->color_primaries;
+    cs->color_trc             = par->color_trc;
+    cs->color_space           = par->color_space;
+    cs->chroma_location       = par->chroma_location;
+    cs->video_delay           = par->video_delay;
+    cs->ch_order              = par->ch_layout.order;
+    cs->nb_channels           = par->ch_layout.nb_channels;
+    cs->ch_mask               = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+    cs->sample_rate           = par->sample_rate;
+    cs->block_align           = par->block_align;
+    cs->frame_size            = par->frame_size;
+    cs->initial_padding       = par->initial_padding;
+    cs->trailing_padding      = par->trailing_padding;
+    cs->seek_preroll          = par->seek_preroll;
+    cs->time_base             = st->time_base;
+    cs->avg_frame_rate        = st->avg_frame_rate;
+    cs->r_frame_rate          = st->r_frame_rate;
+    cs->stream_sample_aspect_ratio = st->sample_aspect_ratio;
+    cs->start_time            = st->start_time;
+    cs->duration              = st->duration;
+    cs->nb_frames             = st->nb_frames;
+    cs->disposition           = st->disposition;
+}
+
+/* takes ownership of extradata */
+static void probe_cache_restore_stream(AVStream *st, const ProbeCacheStream *cs, uint8_t *extradata)
+{
+    AVCodecParameters *par = st->codecpar;
+
+    av_freep(&par->extradata);
+    par->extradata             = extradata;
+    par->extradata_size        = cs->extradata_size;
+    par->codec_tag             = cs->codec_tag;
+    par->format                = cs->format;
+    par->bit_rate              = cs->bit_rate;
+    par->bits_per_coded_sample = cs->bits_per_coded_sample;
+    par->bits_per_raw_sample   = cs->bits_per_raw_sample;
+    par->profile               = cs->profile;
+    par->level                 = cs->level;
+    par->width                 = cs->width;
+    par->height                = cs->height;
+    par->sample_aspect_ratio   = cs->sample_aspect_ratio;
+    par->field_order           = cs->field_order;
+    par->color_range           = cs->color_range;
+    par->color_primaries       = cs->color_primaries;
+    par->color_trc             = cs->color_trc;
+    par->color_space           = cs->color_space;
+    par->chroma_location       = cs->chroma_location;
+    par->video_delay           = cs->video_delay;
+    av_channel_layout_uninit(&par->ch_layout);
+    par->ch_layout.order       = cs->ch_order;
+    par->ch_layout.nb_channels = cs->nb_channels;
+    if (cs->ch_order == AV_CHANNEL_ORDER_NATIVE)
+        par->ch_layout.u.mask  = cs->ch_mask;
+    par->sample_rate           = cs->sample_rate;
+    par->block_align           = cs->block_align;
+    par->frame_size            = cs->frame_size;
+    par->initial_padding       = cs->initial_padding;
+    par->trailing_padding      = cs->trailing_padding;
+    par->seek_preroll          = cs->seek_preroll;
+    st->avg_frame_rate         = cs->avg_frame_rate;
+    st->r_frame_rate           = cs->r_frame_rate;
+    st->sample_aspect_ratio    = cs->stream_sample_aspect_ratio;
+    st->start_time             = cs->start_time;
+    st->duration               = cs->duration;
+    st->nb_frames              = cs->nb_frames;
+    st->disposition            = cs->disposition;
+}
+
+/* Restore what avformat_find_stream_info() found on an earlier open of the
+ * same file. Returns 1 when probing can be skipped, 0 when the cache has no
+ * valid entry or the demuxer does not see the streams it describes. */
+static int probe_cache_load(AVFormatContext *ic, const char *filename)
+{
+    const char *path = local_file_path(filename);
+    ProbeCacheHeader key, hdr;
+    ProbeCacheStream *cs = NULL;
+    uint8_t **extradata = NULL;
+    char *file, *cached_path = NULL;
+    FILE *f;
+    int i, ret = 0;
+
+    if (!path || probe_cache_key(path, &key) < 0 || !(file = probe_cache_file(path)))
+        return 0;
+    f = fopen(file, "rb");
+    av_free(file);
+    if (!f)
+        return 0;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(&hdr, &key, offsetof(ProbeCacheHeader, nb_streams)) ||
+        hdr.nb_streams != ic->nb_streams)
+        goto end;
+    if (!(cached_path = av_malloc(hdr.path_size)) ||
+        fread(cached_path, 1, hdr.path_size, f) != hdr.path_size ||
+        memcmp(cached_path, path, hdr.path_size))
+        goto end;
+
+    cs = av_calloc(hdr.nb_streams, sizeof(*cs));
+    extradata = av_calloc(hdr.nb_streams, sizeof(*extradata));
+    if (!cs || !extradata)
+        goto end;
+    for (i = 0; i < hdr.nb_streams; i++) {
+        const AVStream *st = ic->streams[i];
+
+        if (fread(&cs[i], sizeof(*cs), 1, f) != 1)
+            goto end;
+        /* only fill in streams the demuxer already identified the same way */
+        if (cs[i].id != st->id ||
+            cs[i].codec_type != st->codecpar->codec_type ||
+            cs[i].codec_id != st->codecpar->codec_id ||
+            av_cmp_q(cs[i].time_base, st->time_base) ||
+            cs[i].ch_order == AV_CHANNEL_ORDER_CUSTOM ||
+            cs[i].extradata_size < 0 || cs[i].extradata_size > PROBE_CACHE_MAX_EXTRADATA)
+            goto end;
+        if (cs[i].extradata_size) {
+            if (!(extradata[i] = av_mallocz(cs[i].extradata_size + AV_INPUT_BUFFER_PADDING_SIZE)) ||
+                fread(extradata[i], 1, cs[i].extradata_size, f) != cs[i].extradata_size)
+                goto end;
+        }
+    }
+
+    for (i = 0; i < hdr.nb_streams; i++) {
+        probe_cache_restore_stream(ic->streams[i], &cs[i], extradata[i]);
+        extradata[i] = NULL;
+    }
+    ic->start_time = hdr.start_time;
+    ic->duration   = hdr.duration;
+    ic->bit_rate   = hdr.bit_rate;
+    ret = 1;
+
+end:
+    if (extradata) {
+        for (i = 0; i < hdr.nb_streams; i++)
+            av_free(extradata[i]);
+    }
+    av_free(extradata);
+    av_free(cs);
+    av_free(cached_path);
+    fclose(f);
+    return ret;
+}
+
+/* remember the result of avformat_find_stream_info() for the next open */
+static void probe_cache_save(AVFormatContext *ic, const char *filename)
+{
+    const char *path = local_file_path(filename);
+    ProbeCacheHeader hdr;
+    char *file = NULL, *tmp = NULL;
+    FILE *f;
+    int i, ok;
+
+    if (!path || probe_cache_key(path, &hdr) < 0)
+        return;
+    /* custom channel maps are rare enough to just probe again */
+    for (i = 0; i < ic->nb_streams; i++)
+        if (ic->streams[i]->codecpar->ch_layout.order == AV_CHANNEL_ORDER_CUSTOM)
+            return;
+    hdr.nb_streams = ic->nb_streams;
+    hdr.start_time = ic->start_time;
+    hdr.duration   = ic->duration;
+    hdr.bit_rate   = ic->bit_rate;
+
+    file = probe_cache_file(path);
+    tmp = av_asprintf("%s.tmp", file);
+    if (!file || !tmp || !(f = fopen(tmp, "wb"))) {
+        av_log(NULL, AV_LOG_VERBOSE, "Could not write the probe cache in %s\n", probe_cache_dir);
+        goto end;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(path, 1, hdr.path_size, f) == hdr.path_size;
+    for (i = 0; ok && i < ic->nb_streams; i++) {
+        ProbeCacheStream cs;
+        probe_cache_store_stream(&cs, ic->streams[i]);
+        ok = fwrite(&cs, sizeof(cs), 1, f) == 1 &&
+             (!cs.extradata_size || fwrite(ic->streams[i]->codecpar->extradata, 1, cs.extradata_size, f) == cs.extradata_size);
+    }
+    if (fclose(f) || !ok) {
+        remove(tmp);
+        goto end;
+    }
+#ifdef _WIN32
+    remove(file);
+#endif
+    if (rename(tmp, file) < 0)
+        remove(tmp);
+
+end:
+    av_free(file);
+    av_free(tmp);
+}
+
+/* hand over the packets the read thread still holds back */
+static void read_put_staged(VideoState *is)
+{
+    packet_queue_put_staged(&is->videoq);
+    packet_queue_put_staged(&is->audioq);
+    packet_queue_put_staged(&is->subtitileq);
+}
+
+/* opens the audio decoder and device while the read thread already demuxes */
+static int audio_open_thread(void *arg)
+{
+    VideoState *is = arg;
+
+    if (stream_component_open(is, SDL_AtomicGet(&is->audio_pending), 1) < 0) {
+        SDL_AtomicSet(&is->audio_pending, -1);
+        packet_queue_abort(&is->audioq);
+        packet_queue_flush(&is->audioq);
+        if (is->video_stream < 0) {
+            SDL_Event event;
+
+            av_log(NULL, AV_LOG_FATAL, "Failed to open file '%s' or configure filtergraph\n",
+                   is->filename);
+            event.type = FF_QUIT_EVENT;
+            event.user.data1 = is;
+            SDL_PushEvent(&event);
+        }
+        return 0;
+    }
+    SDL_AtomicSet(&is->audio_pending, -1);
+    refresh_loop_wake(is);
+    startup_mark("audio decoder started");
+    return 0;
+}
+
+/* this thread gets the stream from the disk or the network */
+static int read_thread(void *arg)
+{
+    VideoState *is = arg;
+    AVFormatContext *ic = NULL;
+    int err, i, ret;
+    int st_index[AVMEDIA_TYPE_NB];
+    AVPacket *pkt = NULL;
+    int64_t stream_start_time;
+    int pkt_in_play_range = 0;
+    const AVDictionaryEntry *t;
+    AVDictionary *open_opts = NULL;    /* each input of a mosaic opens with its own copy */
+    int scan_all_pmts_set = 0;
+    int64_t pkt_ts;
+
+    memset(st_index, -1, sizeof(st_index));
+    is->eof = 0;
+
+    pkt = av_packet_alloc();
+    if (!pkt) {
+        av_log(NULL, AV_LOG_FATAL, "Could not allocate packet.\n");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    ic = avformat_alloc_context();
+    if (!ic) {
+        av_log(NULL, AV_LOG_FATAL, "Could not allocate context.\n");
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    ic->interrupt_callback.callback = decode_interrupt_cb;
+    ic->interrupt_callback.opaque = is;
+    if ((ret = av_dict_copy(&open_opts, format_opts, 0)) < 0)
+        goto fail;
+    if (!av_dict_get(open_opts, "scan_all_pmts", NULL, AV_DICT_MATCH_CASE)) {
+        av_dict_set(&open_opts, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
+        scan_all_pmts_set = 1;
+    }
+    /* -lowlatency: probe little and let the demuxer hand out packets as they come */
+    if (lowlatency > 0) {
+        av_dict_set(&open_opts, "fflags", "nobuffer", AV_DICT_DONT_OVERWRITE);
+        av_dict_set(&open_opts, "probesize", "32768", AV_DICT_DONT_OVERWRITE);
+        av_dict_set_int(&open_opts, "analyzeduration", lowlatency * AV_TIME_BASE, AV_DICT_DONT_OVERWRITE);
+    }
+    if (io_mmap) {
+        const char *path = local_file_path(is->filename);
+        if (path && mapped_file_open(is, path) >= 0) {
+            ic->pb = is->mapped_pb;
+            ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else {
+            av_log(NULL, AV_LOG_VERBOSE, "%s: cannot be mapped, using normal I/O\n", is->filename);
+        }
+    }
+    err = avformat_open_input(&ic, is->filename, is->iformat, &open_opts);
+    if (err < 0) {
+        print_error(is->filename, err);
+        ret = -1;
+        goto fail;
+    }
+    startup_mark("input opened");
+    if (scan_all_pmts_set)
+        av_dict_set(&open_opts, "scan_all_pmts", NULL, AV_DICT_MATCH_CASE);
+
+    if ((t = av_dict_get(open_opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+        av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
+        ret = AVERROR_OPTION_NOT_FOUND;
+        goto fail;
+    }
+    is->ic = ic;
+
+    if (genpts)
+        ic->flags |= AVFMT_FLAG_GENPTS;
+
+    av_format_inject_global_side_data(ic);
+
+    if (find_stream_info && probe_cache_dir && probe_cache_load(ic, is->filename) > 0) {
+        av_log(NULL, AV_LOG_VERBOSE, "%s: stream parameters restored from the probe cache\n", is->filename);
+        startup_mark("stream parameters restored from the probe cache");
+    } else if (find_stream_info) {
+        AVDictionary **opts = setup_find_stream_info_opts(ic, codec_opts);
+        int orig_nb_streams = ic->nb_streams;
+
+        err = avformat_find_stream_info(ic, opts);
+
+        for (i = 0; i < orig_nb_streams; i++)
+            av_dict_free(&opts[i]);
+        av_freep(&opts);
+
+        if (err < 0) {
+            av_log(NULL, AV_LOG_WARNING,
+                   "%s: could not find codec parameters\n", is->filename);
+            ret = -1;
+            goto fail;
+        }
+        startup_mark("stream info found");
+        if (probe_cache_dir)
+            probe_cache_save(ic, is->filename);
+    }
+
+    if (ic->pb)
+        ic->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use avio_feof() to test for the end
+
+    if (keyframe_index && local_file_path(is->filename)) {
+        KeyframeIndex *idx = NULL;
+        if (kf_index_open(local_file_path(is->filename), &idx) >= 0) {
+            av_log(NULL, AV_LOG_VERBOSE, "%s: using keyframe index with %d entries\n", is->filename, idx->nb_entries);
+            SDL_AtomicSetPtr((void **)&is->kf_index, idx);
+        } else {
+            is->index_tid = SDL_CreateThread(index_thread, "index_thread", is);
+        }
+    }
+
+    if (seek_by_bytes < 0)
+        seek_by_bytes = !(ic->iformat->flags & AVFMT_NO_BYTE_SEEK) &&
+                        !!(ic->iformat->flags & AVFMT_TS_DISCONT) &&
+                        strcmp("ogg", ic->iformat->name);
+
+    is->max_frame_duration = (ic->iformat->flags & AVFMT_TS_DISCONT) ? 10.0 : 3600.0;
+
+    if (!window_title && (t = av_dict_get(ic->metadata, "title", NULL, 0)))
+        window_title = av_asprintf("%s - %s", t->value, input_filename);
+
+    /* if seeking requested, we execute it */
+    if (start_time != AV_NOPTS_VALUE) {
+        int64_t timestamp;
+
+        timestamp = start_time;
+        /* add the stream start time */
+        if (ic->start_time != AV_NOPTS_VALUE)
+            timestamp += ic->start_time;
+        ret = avformat_seek_file(ic, -1, INT64_MIN, timestamp, INT64_MAX, 0);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_WARNING, "%s: could not seek to position %0.3f\n",
+                    is->filename, (double)timestamp / AV_TIME_BASE);
+        }
+    }
+
+    is->realtime = is_realtime(ic);
+    if (lowlatency > 0 && is->realtime) {
+        /* the latency is held by turning the speed of the external clock */
+        is->av_sync_type = AV_SYNC_EXTERNAL_CLOCK;
+        av_log(NULL, AV_LOG_VERBOSE, "%s: holding a latency of %.0f ms\n", is->filename, lowlatency * 1000);
+    }
+
+    if (show_status)
+        av_dump_format(ic, 0, is->filename, 0);
+
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        enum AVMediaType type = st->codecpar->codec_type;
+        st->discard = AVDISCARD_ALL;
+        if (type >= 0 && wanted_stream_spec[type] && st_index[type] == -1)
+            if (avformat_match_stream_specifier(ic, st, wanted_stream_spec[type]) > 0)
+                st_index[type] = i;
+    }
+    for (i = 0; i < AVMEDIA_TYPE_NB; i++) {
+        if (wanted_stream_spec[i] && st_index[i] == -1) {
+            av_log(NULL, AV_LOG_ERROR, "Stream specifier %s does not match any %s stream\n", wanted_stream_spec[i], av_get_media_type_string(i));
+            st_index[i] = INT_MAX;
+        }
+    }
+
+    if (!video_disable)
+        st_index[AVMEDIA_TYPE_VIDEO] =
+            av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO,
+                                st_index[AVMEDIA_TYPE_VIDEO], -1, NULL, 0);
+    if (!is->audio_disable)
+        st_index[AVMEDIA_TYPE_AUDIO] =
+            av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO,
+                                st_index[AVMEDIA_TYPE_AUDIO],
+                                st_index[AVMEDIA_TYPE_VIDEO],
+                                NULL, 0);
+    if (!video_disable && !subtitle_disable)
+        st_index[AVMEDIA_TYPE_SUBTITLE] =
+            av_find_best_stream(ic, AVMEDIA_TYPE_SUBTITLE,
+                                st_index[AVMEDIA_TYPE_SUBTITLE],
+                                (st_index[AVMEDIA_TYPE_AUDIO] >= 0 ?
+                                 st_index[AVMEDIA_TYPE_AUDIO] :
+                                 st_index[AVMEDIA_TYPE_VIDEO]),
+                                NULL, 0);
+
+    is->show_mode = show_mode;
+    if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
+        AVStream *st = ic->streams[st_index[AVMEDIA_TYPE_VIDEO]];
+        AVCodecParameters *codecpar = st->codecpar;
+        AVRational sar = av_guess_sample_aspect_ratio(ic, st, NULL);
+        if (codecpar->width)
+            set_default_window_size(codecpar->width, codecpar->height, sar);
+    }
+
+    /* open the streams: video first, so that its first frame does not wait
+     * for the audio device, and subtitles only once a packet shows up */
+    ret = -1;
+    if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
+        ret = stream_component_open(is, st_index[AVMEDIA_TYPE_VIDEO], 0);
+        startup_mark("video decoder opened");
+    }
+    if (is->show_mode == SHOW_MODE_NONE)
+        is->show_mode = ret >= 0 ? SHOW_MODE_VIDEO : SHOW_MODE_RDFT;
+
+    if (st_index[AVMEDIA_TYPE_AUDIO] >= 0) {
+        /* audio packets are queued while the decoder and the device open */
+        ic->streams[st_index[AVMEDIA_TYPE_AUDIO]]->discard = AVDISCARD_DEFAULT;
+        packet_queue_start(&is->audioq);
+        SDL_AtomicSet(&is->audio_pending, st_index[AVMEDIA_TYPE_AUDIO]);
+        if (!(is->audio_open_tid = SDL_CreateThread(audio_open_thread, "audio_open", is))) {
+            SDL_AtomicSet(&is->audio_pending, -1);
+            stream_component_open(is, st_index[AVMEDIA_TYPE_AUDIO], 0);
+        }
+    }
+
+    if (st_index[AVMEDIA_TYPE_SUBTITLE] >= 0) {
+        ic->streams[st_index[AVMEDIA_TYPE_SUBTITLE]]->discard = AVDISCARD_DEFAULT;
+        SDL_AtomicSet(&is->subtitle_pending, st_index[AVMEDIA_TYPE_SUBTITLE]);
+    }
+
+    if (is->video_stream < 0 && is->audio_stream < 0 && SDL_AtomicGet(&is->audio_pending) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Failed to open file '%s' or configure filtergraph\n",
+               is->filename);
+        ret = -1;
+        goto fail;
+    }
+
+    if (infinite_buffer < 0 && is->realtime)
+        infinite_buffer = 1;
+
+    if (thumbs_enable && is->video_stream >= 0 && ic->duration > 0 && !is->realtime && !display_disable)
+        thumb_engine_start(is);
+
+    is->readahead_target = FFMAX(readahead_duration, READAHEAD_MIN);
+    readahead_reset(is);
+
+    for (;;) {
+        int mem_tight;
+
+        if (is->abort_request)
+            break;
+        if (is->paused != is->last_paused) {
+            is->last_paused = is->paused;
+            if (is->paused)
+                is->read_pause_return = av_read_pause(ic);
+            else
+                av_read_play(ic);
+        }
+        if (is->paused &&
+                (!strcmp(ic->iformat->name, "rtsp") ||
+                 (ic->pb && !strncmp(input_filename, "mmsh:", 5)))) {
+            /* wait 10 ms to avoid trying to get another packet */
+            /* XXX: horrible */
+            read_put_staged(is);
+            SDL_Delay(10);
+            continue;
+        }
+        if (is->seek_req) {
+            int64_t seek_target = is->seek_pos;
+            int64_t seek_min    = is->seek_rel > 0 ? seek_target - is->seek_rel + 2: INT64_MIN;
+            int64_t seek_max    = is->seek_rel < 0 ? seek_target - is->seek_rel - 2: INT64_MAX;
+            KeyframeIndex *kf_index = SDL_AtomicGetPtr((void **)&is->kf_index);
+            const KeyframeIndexEntry *kf = NULL;
+// FIXME the +-2 is due to rounding being not done in the correct direction in generation
+//      of the seek_pos/seek_rel variables
+
+            /* with an index, go straight to the keyframe's byte offset instead of letting the demuxer search */
+            if (kf_index)
+                kf = is->seek_flags & AVSEEK_FLAG_BYTE ? kf_index_find_pos(kf_index, seek_target) :
+                                                         kf_index_find(kf_index, seek_min, seek_target, seek_max);
+            if (kf && avformat_seek_file(is->ic, -1, kf->pos, kf->pos, kf->pos, AVSEEK_FLAG_BYTE) < 0)
+                kf = NULL;
+            ret = kf ? 0 : avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR,
+                       "%s: error while seeking\n", is->ic->url);
+            } else {
+                /* audioq also holds the packets of a stream audio_open_thread is opening,
+                 * audio_pending is read first as the open sets audio_stream before clearing it */
+                if (SDL_AtomicGet(&is->audio_pending) >= 0 || is->audio_stream >= 0)
+                    packet_queue_flush(&is->audioq);
+                if (is->subtitle_stream >= 0)
+                    packet_queue_flush(&is->subtitileq);
+                if (is->video_stream >= 0)
+                    packet_queue_flush(&is->videoq);
+                if (kf) {
+                   set_clock(&is->extclk, kf->pts / (double)AV_TIME_BASE, 0);
+                } else if (is->seek_flags & AVSEEK_FLAG_BYTE) {
+                   set_clock(&is->extclk, NAN, 0);
+                } else {
+                   set_clock(&is->extclk, seek_target / (double)AV_TIME_BASE, 0);
+                }
+            }
+            is->seek_req = 0;
+            is->live_pts = NAN;
+            is->latency = NAN;
+            is->queue_attachments_req = 1;
+            is->eof = 0;
+            /* the decoders drain the queues after a seek, that is not a starvation */
+            readahead_reset(is);
+            if (is->paused)
+                step_to_next_frame(is);
+            /* the display drops the stale frames it holds at once instead of at its next deadline */
+            SDL_AtomicSet(&is->refresh_waiting, 1);
+            refresh_loop_wake(is);
+        }
+        if (is->queue_attachments_req) {
+            read_put_staged(is);
+            if (is->video_st && is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+                if ((ret = av_packet_ref(pkt, &is->video_st->attached_pic)) < 0)
+                    goto fail;
+                packet_queue_put(&is->videoq, pkt);
+                packet_queue_put_nullpacket(&is->videoq, pkt, is->video_stream);
+            }
+            is->queue_attachments_req = 0;
+        }
+
+        /* if every queue holds the read-ahead target, sleep until a decoder drains one;
+         * -max_mem holds even with -infbuf */
+        mem_tight = readahead_update(is);
+        if ((infinite_buffer<1 && (mem_tight || readahead_queues_full(is))) || read_mem_over(is)) {
+            mem_tight |= read_mem_over(is);
+            read_put_staged(is);
+            SDL_LockMutex(is->continue_read_mutex);
+            /* recheck under the lock so a refill signal cannot be missed */
+            if (!is->abort_request && !is->seek_req && is->paused == is->last_paused &&
+                (mem_tight || readahead_queues_full(is)))
+                SDL_CondWaitTimeout(is->continue_read_thread, is->continue_read_mutex,
+                                    mem_tight ? 10 : READAHEAD_ADJUST_INTERVAL / 1000);
+            SDL_UnlockMutex(is->continue_read_mutex);
+            continue;
+        }
+        if (!is->paused &&
+            (!is->audio_st || (is->auddec.finished == is->audioq.serial && frame_queue_nb_remaining(&is->sampq) == 0)) &&
+            (!is->video_st || (is->viddec.finished == is->videoq.serial && frame_queue_nb_remaining(&is->pictq) == 0))) {
+            if (loop != 1 && (!loop || --loop)) {
+                stream_seek(is, start_time != AV_NOPTS_VALUE ? start_time : 0, 0, 0);
+            } else if (autoexit) {
+                ret = AVERROR_EOF;
+                goto fail;
+            }
+        }
+        ret = av_read_frame(ic, pkt);
+        if (ret < 0) {
+            read_put_staged(is);
+            if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !is->eof) {
+                int audio_index = is->audio_stream >= 0 ? is->audio_stream : SDL_AtomicGet(&is->audio_pending);
+                if (is->video_stream >= 0)
+                    packet_queue_put_nullpacket(&is->videoq, pkt, is->video_stream);
+                if (audio_index >= 0)
+                    packet_queue_put_nullpacket(&is->audioq, pkt, audio_index);
+                if (is->subtitle_stream >= 0)
+                    packet_queue_put_nullpacket(&is->subtitileq, pkt, is->subtitle_stream);
+                is->eof = 1;
+            }
+            if (ic->pb && ic->pb->error) {
+                if (autoexit)
+                    goto fail;
+                else
+                    break;
+            }
+            /* at eof nothing signals the end of decoding, poll for it */
+            SDL_LockMutex(is->continue_read_mutex);
+            if (!is->abort_request && !is->seek_req)
+                SDL_CondWaitTimeout(is->continue_read_thread, is->continue_read_mutex, 10);
+            SDL_UnlockMutex(is->continue_read_mutex);
+            continue;
+        } else {
+            is->eof = 0;
+        }
+        /* check if packet is in play range specified by user, then queue, otherwise discard */
+        stream_start_time = ic->streams[pkt->stream_index]->start_time;
+        pkt_ts = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        pkt_in_play_range = duration == AV_NOPTS_VALUE ||
+                (pkt_ts - (stream_start_time != AV_NOPTS_VALUE ? stream_start_time : 0)) *
+                av_q2d(ic->streams[pkt->stream_index]->time_base) -
+                (double)(start_time != AV_NOPTS_VALUE ? start_time : 0) / 1000000
+                <= ((double)duration / 1000000);
+        if (pkt->stream_index == SDL_AtomicGet(&is->subtitle_pending) &&
+            SDL_AtomicCAS(&is->subtitle_pending, pkt->stream_index, -2)) {
+            stream_component_open(is, pkt->stream_index, 0);
+            startup_mark("subtitle decoder opened");
+            SDL_AtomicSet(&is->subtitle_pending, -1);
+        }
+        if (pkt_in_play_range && pkt_ts != AV_NOPTS_VALUE &&
+            (pkt->stream_index == is->video_stream || pkt->stream_index == is->audio_stream)) {
+            double ts = pkt_ts * av_q2d(ic->streams[pkt->stream_index]->time_base);
+
+            if (isnan(is->live_pts) || ts > is->live_pts)
+                is->live_pts = ts;
+        }
+        if ((pkt->stream_index == is->audio_stream || pkt->stream_index == SDL_AtomicGet(&is->audio_pending)) &&
+            pkt_in_play_range) {
+            packet_queue_stage(&is->audioq, pkt);
+        } else if (pkt->stream_index == is->video_stream && pkt_in_play_range
+                   && !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            packet_queue_stage(&is->videoq, pkt);
+        } else if (pkt->stream_index == is->subtitle_stream && pkt_in_play_range) {
+            packet_queue_stage(&is->subtitileq, pkt);
+        } else {
+            av_packet_unref(pkt);
+        }
+    }
+
+    ret = 0;
+ fail:
+    if (ic && !is->ic)
+        avformat_close_input(&ic);
+
+    av_dict_free(&open_opts);
+    av_packet_free(&pkt);
+    if (ret != 0) {
+        SDL_Event event;
+
+        event.type = FF_QUIT_EVENT;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+    }
+    return 0;
+}
+
+static VideoState* stream_open(const char *filename, const AVInputFormat *iformat)
 {
     VideoState *is;
 
     is = av_mallocz(sizeof(VideoState));
-    if (!is)
+    if (!is || nb_videostates == MAX_INPUTS)
+    {
+            av_free(is);
             return NULL;
+    }
+    SDL_AtomicAdd(&nb_players, 1);
+    videostates[nb_videostates++] = is;
+    is->audio_disable = audio_disable || (mosaic && nb_videostates > 1);
     is->last_video_stream = is->video_stream = -1;
     is->last_subtitle_stream = is->subtitle_stream = -1;
     is->last_audio_stream = is->audio_stream = -1;
+    SDL_AtomicSet(&is->audio_pending, -1);
+    SDL_AtomicSet(&is->subtitle_pending, -1);
     is->filename = av_strdup(filename);
     if (!is->filename)
             goto fail;
@@ -963,82 +5633,775 @@ static VideoState* stream_open(const char *filename, const AVInputFormat *iforma
     is->iformat = iformat;
     is->xleft = 0;
     is->ytop = 0;
+    is->thumb_hover = NAN;
+    is->live_pts = NAN;
+    is->latency = NAN;
+    is->thumb_shown_slot = -1;
 
-    if (frame_queue_init(&is->pictq, &is->videoq, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
+    if (frame_queue_init(&is->pictq, &is->videoq, pictq_size, 1) < 0)
             goto fail;
-    if (frame_queue_init(&is->subq, &is->subtitileq, SUBPICTURE_QUEUE_SIZE, 0) < 0)
+    if (frame_queue_init(&is->subq, &is->subtitileq, subq_size, 0) < 0)
             goto fail;
-    if (frame_queue_init(&is->subq, &is->audioq, SAMPLE_QUEUE_SIZE, 1) < 0)
+    if (frame_queue_init(&is->sampq, &is->audioq, sampq_size, 1) < 0)
             goto fail;
 
     if (packet_queue_init(&is->videoq) < 0 || packet_queue_init(&is->subtitileq) < 0 || packet_queue_init(&is->audioq) < 0)
             goto fail;
 
-    if (!(is->continue_read_thread = SDL_CreateCond()))
-    {
-            av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
-            goto fail;
+    if (!(is->continue_read_thread = SDL_CreateCond()))
+    {
+            av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+            goto fail;
+    }
+    if (!(is->continue_read_mutex = SDL_CreateMutex()))
+    {
+            av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
+            goto fail;
+    }
+    is->videoq.refill_mutex = is->audioq.refill_mutex = is->subtitileq.refill_mutex = is->continue_read_mutex;
+    is->videoq.refill_cond = is->audioq.refill_cond = is->subtitileq.refill_cond = is->continue_read_thread;
+
+    init_clock(&is->vidclk, &is->videoq.serial);
+    init_clock(&is->audclk, &is->audioq.serial);
+    init_clock(&is->extclk, &is->extclk.serial);
+    is->audio_clock_serial = -1;
+    if (startup_volume < 0)
+            av_log(NULL, AV_LOG_WARNING, "-volume=%d < 0, setting to 0\n", startup_volume);
+    if (startup_volume > 100)
+            av_log(NULL, AV_LOG_WARNING, "-volume=%d > 100, setting to 100\n", startup_volume);
+    startup_volume = av_clip(startup_volume, 0, 100);
+    startup_volume = av_clip(SDL_MIX_MAXVOLUME * startup_volume / 100, 0, SDL_MIX_MAXVOLUME);
+    is->audio_volume = startup_volume;
+    is->muted = 0;
+    is->av_sync_type = av_sync_type;
+    is->read_tid = SDL_CreateThread(read_thread, "read_thread", is);
+    if (!is->read_tid)
+    {
+            av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
+    fail:
+            stream_close(is);
+            return NULL;
+    }
+
+    return is;
+}
+
+/* -mosaic: split the window into a grid, one viewport per input */
+static void mosaic_layout(int width, int height)
+{
+    int cols, rows, i;
+
+    if (!nb_videostates)
+        return;
+    cols = (int)ceil(sqrt(nb_videostates));
+    rows = (nb_videostates + cols - 1) / cols;
+    for (i = 0; i < nb_videostates; i++) {
+        VideoState *is = videostates[i];
+        int col = i % cols, row = i / cols;
+
+        is->xleft  = col * width  / cols;
+        is->ytop   = row * height / rows;
+        is->width  = (col + 1) * width  / cols - is->xleft;
+        is->height = (row + 1) * height / rows - is->ytop;
+        if (is->vis_texture) {
+            SDL_DestroyTexture(is->vis_texture);
+            is->vis_texture = NULL;
+        }
+        is->force_refresh = 1;
+    }
+    mosaic_dirty = 1;
+}
+
+static VideoState *mosaic_player_at(int x, int y)
+{
+    int i;
+
+    for (i = 0; i < nb_videostates; i++) {
+        VideoState *is = videostates[i];
+        if (x >= is->xleft && x < is->xleft + is->width && y >= is->ytop && y < is->ytop + is->height)
+            return is;
+    }
+    return NULL;
+}
+
+static void video_open(VideoState *is)
+{
+    int w, h;
+    w = screen_width ? screen_width : default_width;
+    h = screen_height ? screen_height : default_height;
+
+    if (!window_title)
+            window_title = input_filename;
+    SDL_SetWindowTitle(window, window_title);
+
+    SDL_SetWindowSize(window, w, h);
+    SDL_SetWindowPosition(window, screen_left, screen_top);
+    if (is_full_screen)
+            SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
+    SDL_ShowWindow(window);
+
+    if (mosaic)
+    {
+            mosaic_layout(w, h);
+            return;
+    }
+    is->width = w;
+    is->height = h;
+}
+
+static int realloc_texture(SDL_Texture **texture, Uint32 new_format, int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
+{
+    Uint32 format;
+    int access, w, h;
+    if (!*texture || SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 || new_width != w || new_height != h || new_format != format) {
+        void *pixels;
+        int pitch;
+        if (*texture)
+            SDL_DestroyTexture(*texture);
+        if (!(*texture = SDL_CreateTexture(renderer, new_format, SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
+            return -1;
+        if (SDL_SetTextureBlendMode(*texture, blendmode) < 0)
+            return -1;
+        if (init_texture) {
+            if (SDL_LockTexture(*texture, NULL, &pixels, &pitch) < 0)
+                return -1;
+            memset(pixels, 0, pitch * new_height);
+            SDL_UnlockTexture(*texture);
+        }
+        av_log(NULL, AV_LOG_VERBOSE, "Created %dx%d texture with %s.\n", new_width, new_height, SDL_GetPixelFormatName(new_format));
+    }
+    return 0;
+}
+
+static inline int compute_mod(int a, int b)
+{
+    return a < 0 ? a%b + b : a%b;
+}
+
+/* multiply n samples by the analysis window, in place */
+static void vis_apply_window(float *data, const float *window, int n)
+{
+    int x = 0;
+#if USE_SSE2_VISUALIZER
+    for (; x + 4 <= n; x += 4)
+        _mm_storeu_ps(data + x, _mm_mul_ps(_mm_loadu_ps(data + x), _mm_loadu_ps(window + x)));
+#endif
+    for (; x < n; x++)
+        data[x] *= window[x];
+}
+
+/* turn n bins of one or two spectra into packed ARGB8888 pixels, bin 0 first */
+static void vis_spectrum_column(uint32_t *column, const AVComplexFloat *a, const AVComplexFloat *b, int n, float scale)
+{
+    int y = 0;
+#if USE_SSE2_VISUALIZER
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 vmax = _mm_set1_ps(255.0f);
+    for (; y + 4 <= n; y += 4) {
+        __m128 a0 = _mm_loadu_ps(&a[y].re), a1 = _mm_loadu_ps(&a[y + 2].re);
+        __m128 b0 = _mm_loadu_ps(&b[y].re), b1 = _mm_loadu_ps(&b[y + 2].re);
+        __m128 are = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 aim = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 bre = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 bim = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 am = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(are, are), _mm_mul_ps(aim, aim)));
+        __m128 bm = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(bre, bre), _mm_mul_ps(bim, bim)));
+        __m128i ia = _mm_cvttps_epi32(_mm_min_ps(_mm_sqrt_ps(_mm_mul_ps(am, vscale)), vmax));
+        __m128i ib = _mm_cvttps_epi32(_mm_min_ps(_mm_sqrt_ps(_mm_mul_ps(bm, vscale)), vmax));
+        __m128i px = _mm_add_epi32(_mm_slli_epi32(ia, 16), _mm_slli_epi32(ib, 8));
+        px = _mm_add_epi32(px, _mm_srli_epi32(_mm_add_epi32(ia, ib), 1));
+        _mm_storeu_si128((__m128i *)(column + y), px);
+    }
+#endif
+    for (; y < n; y++) {
+        int va = sqrtf(scale * hypotf(a[y].re, a[y].im));
+        int vb = sqrtf(scale * hypotf(b[y].re, b[y].im));
+        va = FFMIN(va, 255);
+        vb = FFMIN(vb, 255);
+        column[y] = (va << 16) + (vb << 8) + ((va + vb) >> 1);
+    }
+}
+
+static int vis_alloc_rdft(VideoState *s, int rdft_bits)
+{
+    const float rdft_scale = 1.0;
+    int nb_freq = 1 << (rdft_bits - 1);
+    int x, ret;
+
+    av_tx_uninit(&s->rdft);
+    av_freep(&s->real_data);
+    av_freep(&s->rdft_data);
+    av_freep(&s->rdft_window);
+    av_freep(&s->vis_column);
+    s->rdft_bits = 0;
+
+    /* two channels at most, each RDFT producing nb_freq + 1 bins */
+    s->real_data   = av_malloc_array(nb_freq, 4 * sizeof(*s->real_data));
+    s->rdft_data   = av_malloc_array(nb_freq + 1, 2 * sizeof(*s->rdft_data));
+    s->rdft_window = av_malloc_array(nb_freq, 2 * sizeof(*s->rdft_window));
+    s->vis_column  = av_malloc_array(nb_freq, sizeof(*s->vis_column));
+    if (!s->real_data || !s->rdft_data || !s->rdft_window || !s->vis_column)
+        return AVERROR(ENOMEM);
+    if ((ret = av_tx_init(&s->rdft, &s->rdft_fn, AV_TX_FLOAT_RDFT, 0, 1 << rdft_bits, &rdft_scale, 0)) < 0)
+        return ret;
+
+    for (x = 0; x < 2 * nb_freq; x++) {
+        double w = (x - nb_freq) * (1.0 / nb_freq);
+        s->rdft_window[x] = 1.0 - w * w;
+    }
+    s->rdft_bits = rdft_bits;
+    return 0;
+}
+
+static void video_audio_display(VideoState *s)
+{
+    int i, i_start, x, y1, y, ys, delay, n, nb_display_channels;
+    int ch, channels, h, h2;
+    int64_t time_diff;
+    int rdft_bits, nb_freq;
+
+    for (rdft_bits = 1; (1 << rdft_bits) < 2 * s->height; rdft_bits++)
+        ;
+    nb_freq = 1 << (rdft_bits - 1);
+
+    /* compute display index : center on currently output samples */
+    channels = s->audio_tgt.ch_layout.nb_channels;
+    nb_display_channels = channels;
+    if (!s->paused) {
+        int data_used= s->show_mode == SHOW_MODE_WAVES ? s->width : (2*nb_freq);
+        n = 2 * channels;
+        delay = s->audio_write_buf_size;
+        delay /= n;
+
+        /* to be more precise, we take into account the time spent since
+           the last buffer computation */
+        if (audio_callback_time) {
+            time_diff = clock_time_us() - audio_callback_time;
+            delay -= (time_diff * s->audio_tgt.freq) / 1000000;
+        }
+
+        delay += 2 * data_used;
+        if (delay < data_used)
+            delay = data_used;
+
+        i_start= x = compute_mod(s->sample_array_index - delay * channels, SAMPLE_ARRAY_SIZE);
+        if (s->show_mode == SHOW_MODE_WAVES) {
+            h = INT_MIN;
+            for (i = 0; i < 1000; i += channels) {
+                int idx = (SAMPLE_ARRAY_SIZE + x - i) % SAMPLE_ARRAY_SIZE;
+                int a = s->sample_array[idx];
+                int b = s->sample_array[(idx + 4 * channels) % SAMPLE_ARRAY_SIZE];
+                int c = s->sample_array[(idx + 5 * channels) % SAMPLE_ARRAY_SIZE];
+                int d = s->sample_array[(idx + 9 * channels) % SAMPLE_ARRAY_SIZE];
+                int score = a - d;
+                if (h < score && (b ^ c) < 0) {
+                    h = score;
+                    i_start = idx;
+                }
+            }
+        }
+
+        s->last_i_start = i_start;
+    } else {
+        i_start = s->last_i_start;
+    }
+
+    if (s->show_mode == SHOW_MODE_WAVES) {
+        /* one batched draw call instead of a fill per sample */
+        SDL_Rect *rect;
+        av_fast_malloc(&s->vis_rects, &s->vis_rects_size, (s->width + 1) * nb_display_channels * sizeof(*s->vis_rects));
+        if (!s->vis_rects)
+            return;
+
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        /* total height for one channel */
+        h = s->height / nb_display_channels;
+        /* graph height / 2 */
+        h2 = (h * 9) / 20;
+        rect = s->vis_rects;
+        for (ch = 0; ch < nb_display_channels; ch++) {
+            i = i_start + ch;
+            y1 = s->ytop + ch * h + (h / 2); /* position of center line */
+            for (x = 0; x < s->width; x++) {
+                y = (s->sample_array[i] * h2) >> 15;
+                if (y < 0) {
+                    y = -y;
+                    ys = y1 - y;
+                } else {
+                    ys = y1;
+                }
+                if (y) {
+                    rect->x = s->xleft + x;
+                    rect->y = ys;
+                    rect->w = 1;
+                    rect->h = y;
+                    rect++;
+                }
+                i += channels;
+                if (i >= SAMPLE_ARRAY_SIZE)
+                    i -= SAMPLE_ARRAY_SIZE;
+            }
+        }
+        if (rect > s->vis_rects)
+            SDL_RenderFillRects(renderer, s->vis_rects, rect - s->vis_rects);
+
+        SDL_SetRenderDrawColor(renderer, 0, 0, 255, 255);
+        rect = s->vis_rects;
+        for (ch = 1; ch < nb_display_channels; ch++) {
+            rect->x = s->xleft;
+            rect->y = s->ytop + ch * h;
+            rect->w = s->width;
+            rect->h = 1;
+            rect++;
+        }
+        if (rect > s->vis_rects)
+            SDL_RenderFillRects(renderer, s->vis_rects, rect - s->vis_rects);
+    } else {
+        int err = 0;
+        if (realloc_texture(&s->vis_texture, SDL_PIXELFORMAT_ARGB8888, s->width, s->height, SDL_BLENDMODE_NONE, 1) < 0)
+            return;
+
+        if (s->xpos >= s->width)
+            s->xpos = 0;
+        nb_display_channels= FFMIN(nb_display_channels, 2);
+        if (rdft_bits != s->rdft_bits)
+            err = vis_alloc_rdft(s, rdft_bits);
+        if (err < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Failed to allocate buffers for RDFT, switching to waves display\n");
+            s->show_mode = SHOW_MODE_WAVES;
+        } else {
+            float *data_in[2];
+            AVComplexFloat *data[2];
+            SDL_Rect rect = {.x = s->xpos, .y = 0, .w = 1, .h = s->height};
+            uint32_t *pixels;
+            int pitch;
+            for (ch = 0; ch < nb_display_channels; ch++) {
+                data_in[ch] = s->real_data + 2 * nb_freq * ch;
+                data[ch] = s->rdft_data + (nb_freq + 1) * ch;
+                i = i_start + ch;
+                for (x = 0; x < 2 * nb_freq; x++) {
+                    data_in[ch][x] = s->sample_array[i];
+                    i += channels;
+                    if (i >= SAMPLE_ARRAY_SIZE)
+                        i -= SAMPLE_ARRAY_SIZE;
+                }
+                vis_apply_window(data_in[ch], s->rdft_window, 2 * nb_freq);
+                s->rdft_fn(s->rdft, data[ch], data_in[ch], sizeof(float));
+                data[ch][0].im = data[ch][nb_freq].re;
+                data[ch][nb_freq].re = 0;
+            }
+            vis_spectrum_column(s->vis_column, data[0], data[nb_display_channels - 1], s->height, 1 / sqrt(nb_freq));
+
+            /* only the column at xpos changes, the rest of the texture is kept */
+            if (!SDL_LockTexture(s->vis_texture, &rect, (void **)&pixels, &pitch)) {
+                pitch >>= 2;
+                for (y = 0; y < s->height; y++)
+                    pixels[(s->height - 1 - y) * pitch] = s->vis_column[y];
+                SDL_UnlockTexture(s->vis_texture);
+            }
+            SDL_RenderCopy(renderer, s->vis_texture, NULL, &(SDL_Rect){ s->xleft, s->ytop, s->width, s->height });
+        }
+        if (!s->paused)
+            s->xpos++;
+    }
+}
+
+static void get_sdl_pix_fmt_and_blendmode(int format, Uint32 *sdl_pix_fmt, SDL_BlendMode *sdl_blendmode)
+{
+    int i;
+    *sdl_blendmode = SDL_BLENDMODE_NONE;
+    *sdl_pix_fmt = SDL_PIXELFORMAT_UNKNOWN;
+    if (format == AV_PIX_FMT_RGB32   ||
+        format == AV_PIX_FMT_RGB32_1 ||
+        format == AV_PIX_FMT_BGR32   ||
+        format == AV_PIX_FMT_BGR32_1)
+        *sdl_blendmode = SDL_BLENDMODE_BLEND;
+    for (i = 0; i < FF_ARRAY_ELEMS(sdl_texture_format_map) - 1; i++) {
+        if (format == sdl_texture_format_map[i].format) {
+            *sdl_pix_fmt = sdl_texture_format_map[i].texture_fmt;
+            return;
+        }
+    }
+}
+
+/* The decoded planes are handed to SDL as they are, SDL copies them into the
+ * texture once. A negative linesize (bottom-up picture) is passed as the last
+ * row with a positive pitch, the caller then flips the texture when drawing. */
+static int upload_texture(SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx) {
+    int ret = 0;
+    Uint32 sdl_pix_fmt;
+    SDL_BlendMode sdl_blendmode;
+    get_sdl_pix_fmt_and_blendmode(frame->format, &sdl_pix_fmt, &sdl_blendmode);
+    if (realloc_texture(tex, sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN ? SDL_PIXELFORMAT_ARGB8888 : sdl_pix_fmt, frame->width, frame->height, sdl_blendmode, 0) < 0)
+        return -1;
+    switch (sdl_pix_fmt) {
+        case SDL_PIXELFORMAT_UNKNOWN:
+            /* This should only happen if we are not using avfilter... */
+            *img_convert_ctx = sws_getCachedContext(*img_convert_ctx,
+                frame->width, frame->height, frame->format, frame->width, frame->height,
+                AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
+            if (*img_convert_ctx != NULL) {
+                uint8_t *pixels[4];
+                int pitch[4];
+                if (!SDL_LockTexture(*tex, NULL, (void **)pixels, pitch)) {
+                    sws_scale(*img_convert_ctx, (const uint8_t * const *)frame->data, frame->linesize,
+                              0, frame->height, pixels, pitch);
+                    SDL_UnlockTexture(*tex);
+                }
+            } else {
+                av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
+                ret = -1;
+            }
+            break;
+        case SDL_PIXELFORMAT_IYUV:
+            if (frame->linesize[0] > 0 && frame->linesize[1] > 0 && frame->linesize[2] > 0) {
+                ret = SDL_UpdateYUVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
+                                                       frame->data[1], frame->linesize[1],
+                                                       frame->data[2], frame->linesize[2]);
+            } else if (frame->linesize[0] < 0 && frame->linesize[1] < 0 && frame->linesize[2] < 0) {
+                ret = SDL_UpdateYUVTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height                    - 1), -frame->linesize[0],
+                                                       frame->data[1] + frame->linesize[1] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[1],
+                                                       frame->data[2] + frame->linesize[2] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[2]);
+            } else {
+                av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+                return -1;
+            }
+            break;
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+        case SDL_PIXELFORMAT_NV12:
+        case SDL_PIXELFORMAT_NV21:
+            if (frame->linesize[0] > 0 && frame->linesize[1] > 0) {
+                ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
+                                                      frame->data[1], frame->linesize[1]);
+            } else if (frame->linesize[0] < 0 && frame->linesize[1] < 0) {
+                ret = SDL_UpdateNVTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height                    - 1), -frame->linesize[0],
+                                                      frame->data[1] + frame->linesize[1] * (AV_CEIL_RSHIFT(frame->height, 1) - 1), -frame->linesize[1]);
+            } else {
+                av_log(NULL, AV_LOG_ERROR, "Mixed negative and positive linesizes are not supported.\n");
+                return -1;
+            }
+            break;
+#endif
+        default:
+            if (frame->linesize[0] < 0) {
+                ret = SDL_UpdateTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
+            } else {
+                ret = SDL_UpdateTexture(*tex, NULL, frame->data[0], frame->linesize[0]);
+            }
+            break;
+    }
+    return ret;
+}
+
+static void set_sdl_yuv_conversion_mode(AVFrame *frame)
+{
+#if SDL_VERSION_ATLEAST(2,0,8)
+    SDL_YUV_CONVERSION_MODE mode = SDL_YUV_CONVERSION_AUTOMATIC;
+    if (frame && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUYV422 || frame->format == AV_PIX_FMT_UYVY422 ||
+                  frame->format == AV_PIX_FMT_NV12 || frame->format == AV_PIX_FMT_NV21)) {
+        if (frame->color_range == AVCOL_RANGE_JPEG)
+            mode = SDL_YUV_CONVERSION_JPEG;
+        else if (frame->colorspace == AVCOL_SPC_BT709)
+            mode = SDL_YUV_CONVERSION_BT709;
+        else if (frame->colorspace == AVCOL_SPC_BT470BG || frame->colorspace == AVCOL_SPC_SMPTE170M)
+            mode = SDL_YUV_CONVERSION_BT601;
+    }
+    SDL_SetYUVConversionMode(mode); /* FIXME: no support for linear transfer */
+#endif
+}
+
+static void sub_atlas_reset(SubAtlas *a)
+{
+    a->nb_shelves = 0;
+    a->used_h = 0;
+    a->nb_entries = 0;
+    a->generation++;
+}
+
+/* first fit on the shelves, a new shelf below them otherwise */
+static int sub_atlas_place(SubAtlas *a, int w, int h, SDL_Rect *rect)
+{
+    SubAtlasShelf *shelf;
+    int i;
+
+    for (i = 0; i < a->nb_shelves; i++) {
+        shelf = &a->shelves[i];
+        /* do not waste a tall shelf on a short rect */
+        if (h <= shelf->h && 4 * h >= 3 * shelf->h && shelf->x + w <= a->w)
+            goto found;
+    }
+    if (a->nb_shelves == SUB_ATLAS_MAX_SHELVES || a->used_h + h > a->h || w > a->w)
+        return AVERROR(ENOSPC);
+    shelf = &a->shelves[a->nb_shelves++];
+    shelf->y = a->used_h;
+    shelf->h = h;
+    shelf->x = 0;
+    a->used_h += h;
+found:
+    rect->x = shelf->x;
+    rect->y = shelf->y;
+    rect->w = w;
+    rect->h = h;
+    shelf->x += w;
+    return 0;
+}
+
+/* Place of the converted sub_rect in the atlas. Only rects not seen before
+ * are converted and uploaded, and only their own region of the texture. */
+static int sub_atlas_get(VideoState *is, const AVSubtitleRect *sub_rect, SDL_Rect *src)
+{
+    SubAtlas *a = &is->sub_atlas;
+    const AVCRC *table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    SubAtlasEntry *e;
+    uint8_t *pixels[4];
+    int pitch[4];
+    uint32_t crc;
+    int i, ret;
+
+    crc = av_crc(table, 0, sub_rect->data[1], 4 * sub_rect->nb_colors);
+    for (i = 0; i < sub_rect->h; i++)
+        crc = av_crc(table, crc, sub_rect->data[0] + i * sub_rect->linesize[0], sub_rect->w);
+    for (i = 0; i < a->nb_entries; i++) {
+        e = &a->entries[i];
+        if (e->crc == crc && e->w == sub_rect->w && e->h == sub_rect->h) {
+            a->hits++;
+            *src = e->rect;
+            return 0;
+        }
     }
 
-    init_clock(&is->vidclk, &is->videoq.serial);
-    init_clock(&is->audclk, &is->audioq.serial);
-    init_clock(&is->extclk, &is->extclk.serial);
-    is->audio_clock_serial = -1;
-    if (startup_volume < 0)
-            av_log(NULL, AV_LOG_WARNING, "-volume=%d < 0, setting to 0\n", startup_volume);
-    if (startup_volume > 100)
-            av_log(NULL, AV_LOG_WARNING, "-volume=%d > 100, setting to 100\n", startup_volume);
-    startup_volume = av_clip(startup_volume, 0, 100);
-    startup_volume = av_clip(SDL_MIX_MAXVOLUME * startup_volume / 100, 0, SDL_MIX_MAXVOLUME);
-    is->audio_volume = startup_volume;
-    is->muted = 0;
-    is->av_sync_type = av_sync_type;
-    is->read_tid = SDL_CreateThread(read_thread, "read_thread", is);
-    if (!is->read_tid)
-    {
-            av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
-    fail:
-            stream_close(is);
-            return NULL;
+    if (a->nb_entries == SUB_ATLAS_MAX_ENTRIES)
+        return AVERROR(ENOSPC);
+    e = &a->entries[a->nb_entries];
+    if ((ret = sub_atlas_place(a, sub_rect->w, sub_rect->h, &e->rect)) < 0)
+        return ret;
+
+    is->sub_convert_ctx = sws_getCachedContext(is->sub_convert_ctx,
+        sub_rect->w, sub_rect->h, AV_PIX_FMT_PAL8,
+        sub_rect->w, sub_rect->h, AV_PIX_FMT_BGRA,
+        0, NULL, NULL, NULL);
+    if (!is->sub_convert_ctx) {
+        av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
+        return AVERROR(EINVAL);
     }
+    if (SDL_LockTexture(is->sub_texture, &e->rect, (void **)pixels, pitch) < 0)
+        return AVERROR_EXTERNAL;
+    sws_scale(is->sub_convert_ctx, (const uint8_t * const *)sub_rect->data, sub_rect->linesize,
+              0, sub_rect->h, pixels, pitch);
+    SDL_UnlockTexture(is->sub_texture);
+
+    e->crc = crc;
+    e->w = sub_rect->w;
+    e->h = sub_rect->h;
+    a->nb_entries++;
+    a->misses++;
+    *src = e->rect;
+    return 0;
+}
 
-    return is;
+static int sub_atlas_upload(VideoState *is, Frame *sp)
+{
+    SubAtlas *a = &is->sub_atlas;
+    int i, ret = 0, retry;
+
+    if (!is->sub_texture) {
+        a->w = renderer_info.max_texture_width  ? FFMIN(SUB_ATLAS_SIZE, renderer_info.max_texture_width)  : SUB_ATLAS_SIZE;
+        a->h = renderer_info.max_texture_height ? FFMIN(SUB_ATLAS_SIZE, renderer_info.max_texture_height) : SUB_ATLAS_SIZE;
+        sub_atlas_reset(a);
+    }
+    if (realloc_texture(&is->sub_texture, SDL_PIXELFORMAT_ARGB8888, a->w, a->h, SDL_BLENDMODE_BLEND, 0) < 0)
+        return AVERROR_EXTERNAL;
+    if (!sp->sub_src && !(sp->sub_src = av_calloc(sp->sub.num_rects, sizeof(*sp->sub_src))))
+        return AVERROR(ENOMEM);
+
+    for (retry = 0; retry < 2; retry++) {
+        for (i = 0; i < sp->sub.num_rects; i++) {
+            AVSubtitleRect *sub_rect = sp->sub.rects[i];
+
+            memset(&sp->sub_src[i], 0, sizeof(sp->sub_src[i]));
+            if (sub_rect->w <= 0 || sub_rect->h <= 0)
+                continue;
+            if ((ret = sub_atlas_get(is, sub_rect, &sp->sub_src[i])) < 0)
+                break;
+        }
+        if (i == sp->sub.num_rects) {
+            sp->sub_atlas_generation = a->generation;
+            return 0;
+        }
+        if (ret != AVERROR(ENOSPC))
+            return ret;
+        /* full, start over with only this subtitle in it */
+        av_log(NULL, AV_LOG_DEBUG, "Subtitle atlas reset after %"PRId64" hits, %"PRId64" misses\n", a->hits, a->misses);
+        sub_atlas_reset(a);
+    }
+    av_log(NULL, AV_LOG_WARNING, "Subtitle does not fit a %dx%d texture\n", a->w, a->h);
+    return ret;
 }
 
-static void video_open(VideoState *is)
+static void video_image_display(VideoState *is)
 {
-    int w, h;
-    w = screen_width ? screen_width : default_width;
-    h = screen_height ? screen_height : default_height;
+    Frame *vp;
+    Frame *sp = NULL;
+    SDL_Rect rect;
+
+    vp = frame_queue_peek_last(&is->pictq);
+    if (is->subtitle_st) {
+        if (frame_queue_nb_remaining(&is->subq) > 0) {
+            sp = frame_queue_peek(&is->subq);
+
+            if (vp->pts >= sp->pts + ((float) sp->sub.start_display_time / 1000)) {
+                if (!sp->uploaded) {
+                    int i;
+                    if (!sp->width || !sp->height) {
+                        sp->width = vp->width;
+                        sp->height = vp->height;
+                    }
+                    for (i = 0; i < sp->sub.num_rects; i++) {
+                        AVSubtitleRect *sub_rect = sp->sub.rects[i];
+
+                        sub_rect->x = av_clip(sub_rect->x, 0, sp->width );
+                        sub_rect->y = av_clip(sub_rect->y, 0, sp->height);
+                        sub_rect->w = av_clip(sub_rect->w, 0, sp->width  - sub_rect->x);
+                        sub_rect->h = av_clip(sub_rect->h, 0, sp->height - sub_rect->y);
+                    }
+                }
+                if (!sp->uploaded || sp->sub_atlas_generation != is->sub_atlas.generation) {
+                    if (sub_atlas_upload(is, sp) < 0)
+                        return;
+                    sp->uploaded = 1;
+                }
+            } else
+                sp = NULL;
+        }
+    }
 
-    if (!window_title)
-            window_title = input_filename;
-    SDL_SetWindowTitle(window, window_title);
+    calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp->width, vp->height, vp->sar);
+    set_sdl_yuv_conversion_mode(vp->frame);
 
-    SDL_SetWindowSize(window, w, h);
-    SDL_SetWindowPosition(window, screen_left, screen_top);
-    if (is_full_screen)
-            SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
-    SDL_ShowWindow(window);
+    if (!vp->uploaded) {
+        int64_t start = av_gettime_relative();
 
-    is->width = w;
-    is->height = h;
+        if (vp->scale_id)
+            scale_pool_wait(scale_pool, is->scale_job, vp->scale_id);
+        if (upload_texture(&is->vid_texture, vp->frame, &is->img_convert_ctx) < 0) {
+            set_sdl_yuv_conversion_mode(NULL);
+            return;
+        }
+        vp->uploaded = 1;
+        vp->flip_v = vp->frame->linesize[0] < 0;
+        /* read by predrop_update() on the video thread, a stale value is harmless */
+        is->render_cost += ((av_gettime_relative() - start) / 1000000.0 - is->render_cost) / 16;
+    }
+
+    SDL_RenderCopyEx(renderer, is->vid_texture, NULL, &rect, 0, NULL, vp->flip_v ? SDL_FLIP_VERTICAL : 0);
+    set_sdl_yuv_conversion_mode(NULL);
+    if (sp) {
+        int i;
+        double xratio = (double)rect.w / (double)sp->width;
+        double yratio = (double)rect.h / (double)sp->height;
+        for (i = 0; i < sp->sub.num_rects; i++) {
+            SDL_Rect *sub_rect = (SDL_Rect*)sp->sub.rects[i];
+            SDL_Rect target = {.x = rect.x + sub_rect->x * xratio,
+                               .y = rect.y + sub_rect->y * yratio,
+                               .w = sub_rect->w * xratio,
+                               .h = sub_rect->h * yratio};
+            if (sp->sub_src[i].w)
+                SDL_RenderCopy(renderer, is->sub_texture, &sp->sub_src[i], &target);
+        }
+    }
 }
 
-static void video_audio_display(VideoState *is)
+/* Draw the preview for the hovered position above the preview bar. The
+ * closest cached one is shown at once, the exact one is asked for. */
+static void thumb_display(VideoState *is)
 {
+    ThumbEngine *e = SDL_AtomicGetPtr((void **)&is->thumbs);
+    SDL_Rect rect;
+    Thumbnail *t;
+    int slot;
+
+    if (!e || isnan(is->thumb_hover))
+        return;
+    slot = av_clip(is->thumb_hover * THUMB_SLOTS, 0, THUMB_SLOTS - 1);
+    SDL_LockMutex(e->mutex);
+    if (e->want_slot != slot) {
+        e->want_slot = slot;
+        SDL_CondSignal(e->cond);
+    }
+    t = thumb_find_nearest(e, slot);
+    if (t && t->slot != is->thumb_shown_slot) {
+        if (realloc_texture(&is->thumb_texture, SDL_PIXELFORMAT_ARGB8888, t->width, t->height, SDL_BLENDMODE_NONE, 0) < 0 ||
+            SDL_UpdateTexture(is->thumb_texture, NULL, t->pixels, t->width * 4) < 0)
+            t = NULL;
+        else
+            is->thumb_shown_slot = t->slot;
+    }
+    if (t) {
+        t->last_used = ++e->uses;
+        rect.w = t->width;
+        rect.h = t->height;
+    }
+    SDL_UnlockMutex(e->mutex);
+    if (!t)
+        return;
+
+    rect.x = av_clip(is->xleft + is->thumb_hover * is->width - rect.w / 2, is->xleft, FFMAX(is->xleft + is->width - rect.w, is->xleft));
+    rect.y = FFMAX(is->ytop + is->height - THUMB_BAR_HEIGHT - rect.h, is->ytop);
+    SDL_RenderCopy(renderer, is->thumb_texture, NULL, &rect);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderDrawRect(renderer, &rect);
+}
 
+/* x, y relative to the viewport of is, negative when the pointer is elsewhere */
+static void thumb_hover_update(VideoState *is, int x, int y)
+{
+    double hover = NAN;
+
+    if (SDL_AtomicGetPtr((void **)&is->thumbs) &&
+        x >= 0 && x < is->width &&
+        y >= is->height - THUMB_BAR_HEIGHT && y < is->height)
+        hover = (double)x / is->width;
+    if (isnan(hover) && isnan(is->thumb_hover))
+        return;
+    is->thumb_hover = hover;
+    is->force_refresh = 1;
 }
 
-static void video_image_display(VideoState *is)
+/* -mosaic: every viewport is drawn again for each present, the back buffer
+ * does not keep them */
+static void mosaic_display(void)
 {
+    int i;
+
+    mosaic_dirty = 0;
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    for (i = 0; i < nb_videostates; i++) {
+        VideoState *is = videostates[i];
 
+        if (!is->width)
+            continue;
+        if (is->audio_st && is->show_mode != SHOW_MODE_VIDEO)
+            video_audio_display(is);
+        else if (is->video_st && is->pictq.rindex_shown)
+            video_image_display(is);
+        thumb_display(is);
+    }
+    SDL_RenderPresent(renderer);
+    if (startup_trace && !SDL_AtomicGet(&startup_reported))
+        startup_report("first frame presented");
 }
 
 static void video_display(VideoState *is)
 {
     if (!is->width)
             video_open(is);
+    if (mosaic)
+    {
+            /* presented once per refresh loop pass, with the other viewports */
+            mosaic_dirty = 1;
+            return;
+    }
 
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
@@ -1046,21 +6409,436 @@ static void video_display(VideoState *is)
             video_audio_display(is);
     else if (is->video_st)
             video_image_display(is);
+    thumb_display(is);
     SDL_RenderPresent(renderer);
+    if (startup_trace && !SDL_AtomicGet(&startup_reported))
+        startup_report("first frame presented");
+}
+
+static double compute_target_delay(double delay, VideoState *is)
+{
+    double sync_threshold, diff = 0;
+
+    /* update delay to follow master synchronisation source */
+    if (get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER) {
+        /* if video is slave, we try to correct big delays by
+           duplicating or deleting a frame */
+        diff = get_clock(&is->vidclk) - get_master_clock(is);
+
+        /* skip or repeat frame. We take into account the
+           delay to compute the threshold. I still don't know
+           if it is the best guess */
+        sync_threshold = FFMAX(AV_SYNC_THRESHOLD_MIN, FFMIN(AV_SYNC_THRESHOLD_MAX, delay));
+        if (!isnan(diff) && fabs(diff) < is->max_frame_duration) {
+            if (diff <= -sync_threshold)
+                delay = FFMAX(0, delay + diff);
+            else if (diff >= sync_threshold && delay > AV_SYNC_FRAMEDUP_THRESHOLD)
+                delay = delay + diff;
+            else if (diff >= sync_threshold)
+                delay = 2 * delay;
+        }
+    }
+
+    av_log(NULL, AV_LOG_TRACE, "video: delay=%0.3f A-V=%f\n",
+            delay, -diff);
+
+    return delay;
 }
 
+static double vp_duration(VideoState *is, Frame *vp, Frame *nextvp) {
+    if (vp->serial == nextvp->serial) {
+        double duration = nextvp->pts - vp->pts;
+        if (isnan(duration) || duration <= 0 || duration > is->max_frame_duration)
+            return vp->duration;
+        else
+            return duration;
+    } else {
+        return 0.0;
+    }
+}
+
+static void update_video_pts(VideoState *is, double pts, int serial)
+{
+    /* update current video pts */
+    set_clock(&is->vidclk, pts, serial);
+    sync_clock_to_slave(&is->extclk, &is->vidclk);
+}
+
+/* called to display each frame */
 static void video_refresh(void *opaque, double *remaining_time)
 {
     VideoState *is = opaque;
     double time;
-    video_display(is);
+
+    Frame *sp, *sp2;
+
+    if (!is->paused && get_master_sync_type(is) == AV_SYNC_EXTERNAL_CLOCK && is->realtime) {
+        if (lowlatency > 0)
+            check_latency_speed(is);
+        else
+            check_external_clock_speed(is);
+    }
+
+    if (!display_disable && is->show_mode != SHOW_MODE_VIDEO && is->audio_st) {
+        time = clock_time();
+        if (is->force_refresh || is->last_vis_time + rdftspeed < time) {
+            video_display(is);
+            is->last_vis_time = time;
+        }
+        *remaining_time = FFMIN(*remaining_time, is->last_vis_time + rdftspeed - time);
+    }
+
+    if (is->video_st) {
+retry:
+        if (frame_queue_nb_remaining(&is->pictq) == 0) {
+            // nothing to do, no picture to display in the queue
+        } else {
+            double last_duration, duration, delay;
+            Frame *vp, *lastvp;
+
+            /* dequeue the picture */
+            lastvp = frame_queue_peek_last(&is->pictq);
+            vp = frame_queue_peek(&is->pictq);
+
+            if (vp->serial != is->videoq.serial) {
+                frame_queue_next(&is->pictq);
+                goto retry;
+            }
+
+            if (lastvp->serial != vp->serial)
+                is->frame_timer = clock_time();
+
+            if (is->paused)
+                goto display;
+
+            /* compute nominal last_duration */
+            last_duration = vp_duration(is, lastvp, vp);
+            delay = compute_target_delay(last_duration, is);
+
+            time= clock_time();
+            if (time < is->frame_timer + delay) {
+                *remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
+                goto display;
+            }
+
+            is->frame_timer += delay;
+            if (delay > 0 && time - is->frame_timer > AV_SYNC_THRESHOLD_MAX)
+                is->frame_timer = time;
+
+            SDL_LockMutex(is->pictq.mutex);
+            if (!isnan(vp->pts))
+                update_video_pts(is, vp->pts, vp->serial);
+            SDL_UnlockMutex(is->pictq.mutex);
+
+            if (frame_queue_nb_remaining(&is->pictq) > 1) {
+                Frame *nextvp = frame_queue_peek_next(&is->pictq);
+                duration = vp_duration(is, vp, nextvp);
+                if(!is->step && (framedrop>0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) && time > is->frame_timer + duration){
+                    is->frame_drops_late++;
+                    frame_queue_next(&is->pictq);
+                    goto retry;
+                }
+            }
+
+            if (is->subtitle_st) {
+                while (frame_queue_nb_remaining(&is->subq) > 0) {
+                    sp = frame_queue_peek(&is->subq);
+
+                    if (frame_queue_nb_remaining(&is->subq) > 1)
+                        sp2 = frame_queue_peek_next(&is->subq);
+                    else
+                        sp2 = NULL;
+
+                    if (sp->serial != is->subtitileq.serial
+                            || (is->vidclk.pts > (sp->pts + ((float) sp->sub.end_display_time / 1000)))
+                            || (sp2 && is->vidclk.pts > (sp2->pts + ((float) sp2->sub.start_display_time / 1000))))
+                    {
+                        /* its rects stay in the atlas, a later subtitle may show them again */
+                        frame_queue_next(&is->subq);
+                    } else {
+                        break;
+                    }
+                }
+            }
+
+            frame_queue_next(&is->pictq);
+            is->force_refresh = 1;
+
+            if (is->step && !is->paused)
+                stream_toggle_pause(is);
+        }
+display:
+        /* display picture */
+        if (!display_disable && is->force_refresh && is->show_mode == SHOW_MODE_VIDEO && is->pictq.rindex_shown)
+            video_display(is);
+    }
+    is->force_refresh = 0;
+    if (show_status) {
+        AVBPrint buf;
+        int64_t cur_time;
+        int aqsize, vqsize, sqsize;
+        int vthreads, athreads;
+        double av_diff;
+
+        cur_time = av_gettime_relative();
+        if (!status_last_time || (cur_time - status_last_time) >= STATUS_INTERVAL) {
+            aqsize = 0;
+            vqsize = 0;
+            sqsize = 0;
+            if (is->audio_st)
+                aqsize = is->audioq.size;
+            if (is->video_st)
+                vqsize = is->videoq.size;
+            if (is->subtitle_st)
+                sqsize = is->subtitileq.size;
+            av_diff = 0;
+            if (is->audio_st && is->video_st)
+                av_diff = get_clock(&is->audclk) - get_clock(&is->vidclk);
+            else if (is->video_st)
+                av_diff = get_master_clock(is) - get_clock(&is->vidclk);
+            else if (is->audio_st)
+                av_diff = get_master_clock(is) - get_clock(&is->audclk);
+
+            vthreads = is->video_st ? is->viddec.avctx->thread_count : 0;
+            athreads = is->audio_st ? is->auddec.avctx->thread_count : 0;
+
+            av_bprint_init(&buf, 0, AV_BPRINT_SIZE_AUTOMATIC);
+            av_bprintf(&buf,
+                      "%7.2f %s:%7.3f fd=%4d sk=%d aq=%5dKB vq=%5dKB sq=%5dB f=%"PRId64"/%"PRId64" vt=%d%c at=%d ur=%d",
+                      get_master_clock(is),
+                      (is->audio_st && is->video_st) ? "A-V" : (is->video_st ? "M-V" : (is->audio_st ? "M-A" : "   ")),
+                      av_diff,
+                      is->frame_drops_early + is->frame_drops_late,
+                      is->predrop_level,
+                      aqsize / 1024,
+                      vqsize / 1024,
+                      sqsize,
+                      is->video_st ? is->viddec.avctx->pts_correction_num_faulty_dts : 0,
+                      is->video_st ? is->viddec.avctx->pts_correction_num_faulty_pts : 0,
+                      vthreads,
+                      is->video_st ? thread_type_name(is->viddec.avctx->active_thread_type)[0] : '-',
+                      athreads,
+                      SDL_AtomicGet(&is->audio_underruns));
+            if (lowlatency > 0 && is->realtime)
+                av_bprintf(&buf, " lat=%5.0fms x%.3f", is->latency * 1000, is->extclk.speed);
+            av_bprintf(&buf, "   \r");
+
+            if (show_status == 1 && AV_LOG_INFO > av_log_get_level())
+                fprintf(stderr, "%s", buf.str);
+            else
+                av_log(NULL, AV_LOG_INFO, "%s", buf.str);
+
+            fflush(stderr);
+            av_bprint_finalize(&buf, NULL);
+
+            status_last_time = cur_time;
+        }
+    }
+}
+
+static void stream_cycle_channel(VideoState *is, int codec_type)
+{
+    AVFormatContext *ic = is->ic;
+    int start_index, stream_index;
+    int old_index;
+    AVStream *st;
+    AVProgram *p = NULL;
+    int nb_streams = is->ic->nb_streams;
+
+    /* the initial audio and subtitle streams may still be opening on the read side */
+    if (codec_type == AVMEDIA_TYPE_AUDIO && (is->audio_disable || SDL_AtomicGet(&is->audio_pending) >= 0))
+        return;
+    if (codec_type == AVMEDIA_TYPE_SUBTITLE) {
+        int pending = SDL_AtomicGet(&is->subtitle_pending);
+        if (pending == -2 || (pending >= 0 && !SDL_AtomicCAS(&is->subtitle_pending, pending, -1)))
+            return;
+    }
+
+    if (codec_type == AVMEDIA_TYPE_VIDEO) {
+        start_index = is->last_video_stream;
+        old_index = is->video_stream;
+    } else if (codec_type == AVMEDIA_TYPE_AUDIO) {
+        start_index = is->last_audio_stream;
+        old_index = is->audio_stream;
+    } else {
+        start_index = is->last_subtitle_stream;
+        old_index = is->subtitle_stream;
+    }
+    stream_index = start_index;
+
+    if (codec_type != AVMEDIA_TYPE_VIDEO && is->video_stream != -1) {
+        p = av_find_program_from_stream(ic, NULL, is->video_stream);
+        if (p) {
+            nb_streams = p->nb_stream_indexes;
+            for (start_index = 0; start_index < nb_streams; start_index++)
+                if (p->stream_index[start_index] == stream_index)
+                    break;
+            if (start_index == nb_streams)
+                start_index = -1;
+            stream_index = start_index;
+        }
+    }
+
+    for (;;) {
+        if (++stream_index >= nb_streams)
+        {
+            if (codec_type == AVMEDIA_TYPE_SUBTITLE)
+            {
+                stream_index = -1;
+                is->last_subtitle_stream = -1;
+                goto the_end;
+            }
+            if (start_index == -1)
+                return;
+            stream_index = 0;
+        }
+        if (stream_index == start_index)
+            return;
+        st = is->ic->streams[p ? p->stream_index[stream_index] : stream_index];
+        if (st->codecpar->codec_type == codec_type) {
+            /* check that parameters are OK */
+            switch (codec_type) {
+            case AVMEDIA_TYPE_AUDIO:
+                if (st->codecpar->sample_rate != 0 &&
+                    st->codecpar->ch_layout.nb_channels != 0)
+                    goto the_end;
+                break;
+            case AVMEDIA_TYPE_VIDEO:
+            case AVMEDIA_TYPE_SUBTITLE:
+                goto the_end;
+            default:
+                break;
+            }
+        }
+    }
+ the_end:
+    if (p && stream_index != -1)
+        stream_index = p->stream_index[stream_index];
+    av_log(NULL, AV_LOG_INFO, "Switch %s stream from #%d to #%d\n",
+           av_get_media_type_string(codec_type),
+           old_index,
+           stream_index);
+
+    stream_component_close(is, old_index);
+    stream_component_open(is, stream_index, 0);
+}
+
+static void toggle_full_screen(VideoState *is)
+{
+    is_full_screen = !is_full_screen;
+    SDL_SetWindowFullscreen(window, is_full_screen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+}
+
+static void toggle_audio_display(VideoState *is)
+{
+    int next = is->show_mode;
+    do {
+        next = (next + 1) % SHOW_MODE_NB;
+    } while (next != is->show_mode && (next == SHOW_MODE_VIDEO && !is->video_st || next != SHOW_MODE_VIDEO && !is->audio_st));
+    if (is->show_mode != next) {
+        is->force_refresh = 1;
+        is->show_mode = next;
+    }
+}
+
+/* with a virtual clock, time only moves on while the decoders are ahead of it,
+ * so a run does not depend on how fast the machine decodes. A decoder held
+ * back by -max_mem counts as ahead, or "-vclock -max_mem 1M" on a 1080p
+ * input would wait forever for queues that cannot fill. */
+static int vclock_ready(VideoState *is)
+{
+    if (is->paused)
+        return 1;
+    if (is->video_st && is->viddec.finished != is->videoq.serial && !frame_queue_full(&is->pictq))
+        return 0;
+    if (is->audio_st && is->auddec.finished != is->audioq.serial && !frame_queue_full(&is->sampq))
+        return 0;
+    return 1;
+}
+
+/* hand the virtual audio output everything it played up to now */
+static void vclock_play_audio(VideoState *is)
+{
+    int64_t now = clock_time_us();
+    int64_t len;
+
+    if (!is->audio_st || is->audio_tgt.bytes_per_sec <= 0)
+        return;
+    if (!is->vclock_audio_start) {
+        is->vclock_audio_start = now;
+        is->vclock_audio_bytes = 0;
+    }
+    len = av_rescale(now - is->vclock_audio_start, is->audio_tgt.bytes_per_sec, 1000000) - is->vclock_audio_bytes;
+    len = len / is->audio_tgt.frame_size * is->audio_tgt.frame_size;
+    if (len <= 0)
+        return;
+    av_fast_malloc(&is->vclock_audio_buf, &is->vclock_audio_buf_size, len);
+    if (!is->vclock_audio_buf)
+        return;
+    sdl_audio_callback(is, is->vclock_audio_buf, len);
+    is->vclock_audio_bytes += len;
+}
+
+static void vclock_advance(VideoState *is, double remaining_time)
+{
+    int64_t step = vclock_mode == VCLOCK_STEP ? vclock_step : (int64_t)(remaining_time * 1000000.0);
+
+    if (is->paused) {
+        /* nothing is consumed while paused, do not spin */
+        av_usleep((int64_t)(REFRESH_RATE * 1000000.0));
+    } else if (!vclock_ready(is)) {
+        av_usleep(1000);
+        return;
+    }
+    if (step > 0) {
+        SDL_AtomicLock(&vclock_lock);
+        vclock_now += step;
+        SDL_AtomicUnlock(&vclock_lock);
+    }
+    vclock_play_audio(is);
+}
+
+/* Refresh one player. Lowers *remaining_time to its next frame deadline and
+ * returns 0 if it has nothing to do until another thread wakes it. */
+static int refresh_player(VideoState *is, double *remaining_time)
+{
+    double time = REFRESH_MAX_SLEEP;
+    int active = is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh);
+
+    if (active)
+    {
+            video_refresh(is, &time);
+            /* the external clock speed of live streams needs polling */
+            if (is->realtime)
+               time = FFMIN(time, REFRESH_RATE);
+            /* and a status line that is printed wants its next one on time */
+            if (show_status == 1 || (show_status && av_log_get_level() >= AV_LOG_INFO))
+               time = FFMIN(time, FFMAX(status_last_time + STATUS_INTERVAL - av_gettime_relative(), 0) / 1000000.0);
+    }
+    if (!active || time >= REFRESH_MAX_SLEEP)
+    {
+            /* no deadline, let the other threads wake us and recheck what
+               they may have done before they could see the flag */
+            SDL_AtomicSet(&is->refresh_waiting, 1);
+            if (active ? frame_queue_nb_remaining(&is->pictq) > 0 :
+                         is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh))
+               time = 0;
+            else if (!active)
+               return 0;
+    }
+    *remaining_time = FFMIN(*remaining_time, time);
+    return 1;
 }
 
+/* Run video_refresh() of every player at its frame deadlines and return the
+ * next event. The loop sleeps until the deadline or an event, and fully
+ * while everything is paused. */
 static void refresh_loop_wait_event(VideoState *is, SDL_Event *event)
 {
     double remaining_time = 0.0;
-    SDL_PumpEvents();
-    while (!SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT))
+    int active, timeout, got_event, i;
+
+    for (;;)
     {
             if (!cursor_hidden && av_gettime_relative() - cursor_last_shown > CURSOR_HIDE_DELAY)
             {
@@ -1068,36 +6846,418 @@ static void refresh_loop_wait_event(VideoState *is, SDL_Event *event)
             cursor_hidden = 1;
             }
 
-            if (remaining_time > 0.0)
-               av_usleep((int64_t)(remaining_time * 1000000.0));
+            if (vclock_mode)
+            {
+            /* virtual time is moved by this loop, it never waits for it */
+            vclock_advance(is, remaining_time);
             remaining_time = REFRESH_RATE;
-            if (is->show_mode != SHOW_MODE_NONE && (!is->paused || is->force_refresh))
-               video_refresh(is, &remaining_time);
+            for (i = 0; i < nb_videostates; i++)
+                if (videostates[i]->show_mode != SHOW_MODE_NONE && (!videostates[i]->paused || videostates[i]->force_refresh))
+                    video_refresh(videostates[i], &remaining_time);
+            if (mosaic_dirty)
+                mosaic_display();
             SDL_PumpEvents();
+            while (SDL_PeepEvents(event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT) > 0)
+                if (event->type != FF_REFRESH_EVENT)
+                    return;
+            continue;
+            }
+
+            remaining_time = REFRESH_MAX_SLEEP;
+            active = 0;
+            for (i = 0; i < nb_videostates; i++)
+               active |= refresh_player(videostates[i], &remaining_time);
+            if (mosaic_dirty)
+               mosaic_display();
+
+            timeout = active ? (int)ceil(remaining_time * 1000.0) : -1;
+            if (!cursor_hidden)
+            {
+            int hide = (int)((cursor_last_shown + CURSOR_HIDE_DELAY - av_gettime_relative()) / 1000) + 1;
+            timeout = timeout < 0 ? FFMAX(hide, 0) : FFMIN(timeout, FFMAX(hide, 0));
+            }
+
+            got_event = timeout < 0 ? SDL_WaitEvent(event) : SDL_WaitEventTimeout(event, timeout);
+            for (i = 0; i < nb_videostates; i++)
+               SDL_AtomicSet(&videostates[i]->refresh_waiting, 0);
+            if (got_event && event->type != FF_REFRESH_EVENT)
+               return;
     }
 }
 
+static void seek_chapter(VideoState *is, int incr)
+{
+    int64_t pos = get_master_clock(is) * AV_TIME_BASE;
+    int i;
+
+    if (!is->ic->nb_chapters)
+        return;
+
+    /* find the current chapter */
+    for (i = 0; i < is->ic->nb_chapters; i++) {
+        AVChapter *ch = is->ic->chapters[i];
+        if (av_compare_ts(pos, AV_TIME_BASE_Q, ch->start, ch->time_base) < 0) {
+            i--;
+            break;
+        }
+    }
+
+    i += incr;
+    i = FFMAX(i, 0);
+    if (i >= is->ic->nb_chapters)
+        return;
+
+    av_log(NULL, AV_LOG_VERBOSE, "Seeking to chapter %d.\n", i);
+    stream_seek(is, av_rescale_q(is->ic->chapters[i]->start, is->ic->chapters[i]->time_base,
+                                 AV_TIME_BASE_Q), 0, 0);
+}
+
 static void event_loop(VideoState *cur_stream)
 {
     SDL_Event event;
     double incr, pos, frac;
+    int i;
 
     for (;;)
     {
             double x;
             refresh_loop_wait_event(cur_stream, &event);
             switch (event.type) {
+            case SDL_KEYDOWN:
+                if (exit_on_keydown || event.key.keysym.sym == SDLK_ESCAPE || event.key.keysym.sym == SDLK_q) {
+                    do_exit(cur_stream);
+                    break;
+                }
+                // If we don't yet have a window, skip all key events, because read_thread might still be initializing...
+                if (!cur_stream->width)
+                    continue;
+                switch (event.key.keysym.sym) {
+                case SDLK_f:
+                    toggle_full_screen(cur_stream);
+                    cur_stream->force_refresh = 1;
+                    break;
+                case SDLK_p:
+                case SDLK_SPACE:
+                    toggle_pause(cur_stream);
+                    break;
+                case SDLK_m:
+                    toggle_mute(cur_stream);
+                    break;
+                case SDLK_KP_MULTIPLY:
+                case SDLK_0:
+                    update_volume(cur_stream, 1, SDL_VOLUME_STEP);
+                    break;
+                case SDLK_KP_DIVIDE:
+                case SDLK_9:
+                    update_volume(cur_stream, -1, SDL_VOLUME_STEP);
+                    break;
+                case SDLK_s: // S: Step to next frame
+                    step_to_next_frame(cur_stream);
+                    break;
+                case SDLK_i:
+                    wait_stats_dump(&cur_stream, 1, wait_stats_file);
+                    break;
+                case SDLK_a:
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_AUDIO);
+                    break;
+                case SDLK_v:
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_VIDEO);
+                    break;
+                case SDLK_c:
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_VIDEO);
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_AUDIO);
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_SUBTITLE);
+                    break;
+                case SDLK_t:
+                    stream_cycle_channel(cur_stream, AVMEDIA_TYPE_SUBTITLE);
+                    break;
+                case SDLK_w:
+                    if (cur_stream->show_mode == SHOW_MODE_VIDEO && cur_stream->vfilter_idx < nb_vfilters - 1) {
+                        if (++cur_stream->vfilter_idx >= nb_vfilters)
+                            cur_stream->vfilter_idx = 0;
+                    } else {
+                        cur_stream->vfilter_idx = 0;
+                        toggle_audio_display(cur_stream);
+                    }
+                    break;
+                case SDLK_PAGEUP:
+                    if (cur_stream->ic->nb_chapters <= 1) {
+                        incr = 600.0;
+                        goto do_seek;
+                    }
+                    seek_chapter(cur_stream, 1);
+                    break;
+                case SDLK_PAGEDOWN:
+                    if (cur_stream->ic->nb_chapters <= 1) {
+                        incr = -600.0;
+                        goto do_seek;
+                    }
+                    seek_chapter(cur_stream, -1);
+                    break;
+                case SDLK_LEFT:
+                    incr = seek_interval ? -seek_interval : -10.0;
+                    goto do_seek;
+                case SDLK_RIGHT:
+                    incr = seek_interval ? seek_interval : 10.0;
+                    goto do_seek;
+                case SDLK_UP:
+                    incr = 60.0;
+                    goto do_seek;
+                case SDLK_DOWN:
+                    incr = -60.0;
+                do_seek:
+                    if (seek_by_bytes) {
+                        pos = -1;
+                        if (pos < 0 && cur_stream->video_stream >= 0)
+                            pos = frame_queue_last_pos(&cur_stream->pictq);
+                        if (pos < 0 && cur_stream->audio_stream >= 0)
+                            pos = frame_queue_last_pos(&cur_stream->sampq);
+                        if (pos < 0)
+                            pos = avio_tell(cur_stream->ic->pb);
+                        if (cur_stream->ic->bit_rate)
+                            incr *= cur_stream->ic->bit_rate / 8.0;
+                        else
+                            incr *= 180000.0;
+                        pos += incr;
+                        stream_seek(cur_stream, pos, incr, 1);
+                    } else {
+                        pos = get_master_clock(cur_stream);
+                        if (isnan(pos))
+                            pos = (double)cur_stream->seek_pos / AV_TIME_BASE;
+                        pos += incr;
+                        if (cur_stream->ic->start_time != AV_NOPTS_VALUE && pos < cur_stream->ic->start_time / (double)AV_TIME_BASE)
+                            pos = cur_stream->ic->start_time / (double)AV_TIME_BASE;
+                        stream_seek(cur_stream, (int64_t)(pos * AV_TIME_BASE), (int64_t)(incr * AV_TIME_BASE), 0);
+                    }
+                    break;
+                default:
+                    break;
+                }
+                break;
+            case SDL_MOUSEBUTTONDOWN:
+                if (exit_on_mousedown) {
+                    do_exit(cur_stream);
+                    break;
+                }
+                if (mosaic) {
+                    /* keys and seeks go to the viewport clicked last */
+                    VideoState *clicked = mosaic_player_at(event.button.x, event.button.y);
+                    if (clicked)
+                        cur_stream = clicked;
+                }
+                if (event.button.button == SDL_BUTTON_LEFT) {
+                    static int64_t last_mouse_left_click = 0;
+                    if (av_gettime_relative() - last_mouse_left_click <= 500000) {
+                        toggle_full_screen(cur_stream);
+                        cur_stream->force_refresh = 1;
+                        last_mouse_left_click = 0;
+                    } else {
+                        last_mouse_left_click = av_gettime_relative();
+                    }
+                }
+            case SDL_MOUSEMOTION:
+                if (cursor_hidden) {
+                    SDL_ShowCursor(1);
+                    cursor_hidden = 0;
+                }
+                cursor_last_shown = av_gettime_relative();
+                if (event.type == SDL_MOUSEBUTTONDOWN) {
+                    if (event.button.button != SDL_BUTTON_RIGHT)
+                        break;
+                    x = event.button.x - cur_stream->xleft;
+                } else {
+                    {
+                        /* under -mosaic the previews follow the pointer, not the viewport clicked last */
+                        VideoState *hovered = mosaic ? mosaic_player_at(event.motion.x, event.motion.y) : cur_stream;
+
+                        for (i = 0; i < nb_videostates; i++) {
+                            VideoState *vs = videostates[i];
+
+                            if (vs == hovered)
+                                thumb_hover_update(vs, event.motion.x - vs->xleft, event.motion.y - vs->ytop);
+                            else
+                                thumb_hover_update(vs, -1, -1);
+                        }
+                    }
+                    if (!(event.motion.state & SDL_BUTTON_RMASK))
+                        break;
+                    x = event.motion.x - cur_stream->xleft;
+                }
+                if (seek_by_bytes || cur_stream->ic->duration <= 0) {
+                    uint64_t size =  avio_size(cur_stream->ic->pb);
+                    stream_seek(cur_stream, size*x/cur_stream->width, 0, 1);
+                } else {
+                    int64_t ts;
+                    int ns, hh, mm, ss;
+                    int tns, thh, tmm, tss;
+                    tns  = cur_stream->ic->duration / 1000000LL;
+                    thh  = tns / 3600;
+                    tmm  = (tns % 3600) / 60;
+                    tss  = (tns % 60);
+                    frac = x / cur_stream->width;
+                    ns   = frac * tns;
+                    hh   = ns / 3600;
+                    mm   = (ns % 3600) / 60;
+                    ss   = (ns % 60);
+                    av_log(NULL, AV_LOG_INFO,
+                           "Seek to %2.0f%% (%2d:%02d:%02d) of total duration (%2d:%02d:%02d)       \n", frac*100,
+                            hh, mm, ss, thh, tmm, tss);
+                    ts = frac * cur_stream->ic->duration;
+                    if (cur_stream->ic->start_time != AV_NOPTS_VALUE)
+                        ts += cur_stream->ic->start_time;
+                    stream_seek(cur_stream, ts, 0, 0);
+                }
+                break;
+            case SDL_WINDOWEVENT:
+                switch (event.window.event) {
+                    case SDL_WINDOWEVENT_SIZE_CHANGED:
+                        if (mosaic) {
+                            screen_width  = event.window.data1;
+                            screen_height = event.window.data2;
+                            mosaic_layout(screen_width, screen_height);
+                            break;
+                        }
+                        screen_width  = cur_stream->width  = event.window.data1;
+                        screen_height = cur_stream->height = event.window.data2;
+                        if (cur_stream->vis_texture) {
+                            SDL_DestroyTexture(cur_stream->vis_texture);
+                            cur_stream->vis_texture = NULL;
+                        }
+                    case SDL_WINDOWEVENT_EXPOSED:
+                        cur_stream->force_refresh = 1;
+                        mosaic_dirty = mosaic;
+                }
+                break;
+            case FF_QUIT_EVENT:
+                if (mosaic && nb_videostates > 1) {
+                    /* one input failed or ended, the others keep playing */
+                    VideoState *done = event.user.data1;
+                    int w, h;
+                    for (i = 0; i < nb_videostates && videostates[i] != done; i++)
+                        ;
+                    if (i < nb_videostates) {
+                        stream_close(done);
+                        if (cur_stream == done)
+                            cur_stream = videostates[0];
+                        SDL_GetWindowSize(window, &w, &h);
+                        mosaic_layout(w, h);
+                    }
+                    break;
+                }
+            case SDL_QUIT:
+                do_exit(cur_stream);
+                break;
             default:
-               break;
+                break;
             }
     }
 }
 
+/* what the renderer would do with a picture it cannot upload directly */
+static void bench_convert_frame(VideoState *is, AVFrame *frame, uint8_t **buf, unsigned *buf_size)
+{
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    int i, size;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(sdl_texture_format_map) - 1; i++)
+        if (frame->format == sdl_texture_format_map[i].format)
+            return;
+
+    is->img_convert_ctx = sws_getCachedContext(is->img_convert_ctx,
+        frame->width, frame->height, frame->format, frame->width, frame->height,
+        AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
+    size = av_image_get_buffer_size(AV_PIX_FMT_BGRA, frame->width, frame->height, 1);
+    if (!is->img_convert_ctx || size < 0)
+        return;
+    av_fast_malloc(buf, buf_size, size);
+    if (!*buf)
+        return;
+    av_image_fill_arrays(dst_data, dst_linesize, *buf, AV_PIX_FMT_BGRA, frame->width, frame->height, 1);
+    sws_scale(is->img_convert_ctx, (const uint8_t * const *)frame->data, frame->linesize,
+              0, frame->height, dst_data, dst_linesize);
+}
+
+static int bench_finished(VideoState *is)
+{
+    return is->eof && SDL_AtomicGet(&is->audio_pending) < 0 &&
+           (!is->audio_st || (is->auddec.finished == is->audioq.serial && frame_queue_nb_remaining(&is->sampq) == 0)) &&
+           (!is->video_st || (is->viddec.finished == is->videoq.serial && frame_queue_nb_remaining(&is->pictq) == 0));
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t va = *(const int64_t *)a, vb = *(const int64_t *)b;
+    return (va > vb) - (va < vb);
+}
+
+static void bench_report_stream(const char *type, Decoder *d, AVStream *st, double elapsed)
+{
+    DecoderStats *s = &d->stats;
+    int64_t p50 = 0, p99 = 0;
+
+    if (!st)
+        return;
+    if (s->nb_frame_times) {
+        qsort(s->frame_times, s->nb_frame_times, sizeof(*s->frame_times), cmp_int64);
+        p50 = s->frame_times[(int64_t)(s->nb_frame_times - 1) * 50 / 100];
+        p99 = s->frame_times[(int64_t)(s->nb_frame_times - 1) * 99 / 100];
+    }
+    printf("bench: %-8s #%d %-12s %8"PRId64" frames %9.1f fps %9.1f pkt/s %8.2f MB/s  decode p50 %.3f ms p99 %.3f ms\n",
+           type, st->index, d->avctx->codec->name, s->nb_frames,
+           s->nb_frames / elapsed, s->nb_packets / elapsed, s->nb_bytes / elapsed / (1024 * 1024),
+           p50 / 1000.0, p99 / 1000.0);
+}
+
+/* -bench: drain every frame queue as fast as the decoders fill them */
+static void bench_loop(VideoState *is)
+{
+    SDL_Event event;
+    uint8_t *buf = NULL;
+    unsigned buf_size = 0;
+    int64_t start = av_gettime_relative();
+    double elapsed;
+
+    for (;;) {
+        int idle = 1;
+
+        if (SDL_PeepEvents(&event, 1, SDL_GETEVENT, FF_QUIT_EVENT, FF_QUIT_EVENT) > 0)
+            break;
+        if (is->video_st && frame_queue_nb_remaining(&is->pictq) > 0) {
+            bench_convert_frame(is, frame_queue_peek(&is->pictq)->frame, &buf, &buf_size);
+            frame_queue_next(&is->pictq);
+            idle = 0;
+        }
+        if (is->subtitle_st && frame_queue_nb_remaining(&is->subq) > 0) {
+            frame_queue_next(&is->subq);
+            idle = 0;
+        }
+        if (is->audio_st && frame_queue_nb_remaining(&is->sampq) > 0) {
+            audio_decode_frame(is);
+            idle = 0;
+        }
+        if (idle) {
+            if (bench_finished(is))
+                break;
+            av_usleep(1000);
+        }
+    }
+
+    elapsed = FFMAX(av_gettime_relative() - start, 1) / 1000000.0;
+    printf("bench: %s decoded in %.3f s\n", is->filename, elapsed);
+    bench_report_stream("video", &is->viddec, is->video_st, elapsed);
+    bench_report_stream("audio", &is->auddec, is->audio_st, elapsed);
+    bench_report_stream("subtitle", &is->subdec, is->subtitle_st, elapsed);
+    av_free(buf);
+    do_exit(is);
+}
+
 int main(int argc, char *argv[])
 {
-    int flags;
+    int flags, i;
     VideoState *is;
 
+    startup_time = av_gettime_relative();
     init_dynload();
 
     av_log_set_flags(AV_LOG_SKIP_REPEATED);
@@ -1112,6 +7272,7 @@ int main(int argc, char *argv[])
     show_banner(argc, argv, options);
 
     parse_options(NULL, argc, argv, options, opt_input_file);
+    startup_mark("options parsed");
 
     if (!input_filename)
     {
@@ -1124,13 +7285,47 @@ int main(int argc, char *argv[])
 
     printf("filename: %s\n", input_filename);
 
-    if (display_disable)
+    if (build_index)
+    {
+            int ret = kf_index_build(input_filename, file_iformat, NULL);
+            if (ret < 0)
+                    print_error(input_filename, ret);
+            exit(ret < 0);
+    }
+
+    if (mosaic && (bench || build_index || nb_input_filenames < 2))
+    {
+            /* only the first input is used then */
+            mosaic = 0;
+            nb_input_filenames = 1;
+    }
+    else if (mosaic)
+    {
+            /* the inputs share the cores, one filter thread each is plenty */
+            if (!filter_nbthreads)
+                    filter_nbthreads = 1;
+            if (!screen_width && !screen_height)
+            {
+                    default_width  = 1280;
+                    default_height = 720;
+            }
+    }
+
+    if (bench)
+    {
+            /* decode everything once, as fast as possible, with nothing to pace it */
+            display_disable = 1;
+            loop = 1;
+            autoexit = 0;
+            framedrop = 0;
+    }
+    else if (display_disable)
     {
             video_disable = 1;
     }
 
     flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
-    if (audio_disable)
+    if (audio_disable || bench)
     {
             flags &= ~SDL_INIT_AUDIO;
     }
@@ -1140,10 +7335,14 @@ int main(int argc, char *argv[])
             SDL_setenv("SDL_AUDIO_ALSA_SET_BUFFER_SIZE","1", 1);
     }
 
-    if (video_disable)
+    if (video_disable || bench)
     {
             flags &= ~SDL_INIT_VIDEO;
     }
+    if (bench)
+    {
+            flags |= SDL_INIT_EVENTS;
+    }
 
     if (SDL_Init(flags))
     {
@@ -1151,10 +7350,36 @@ int main(int argc, char *argv[])
             av_log(NULL, AV_LOG_FATAL, "(Did you set the DISPLAY variable?)\n");
             exit(1);
     }
+    startup_mark("SDL initialized");
 
     SDL_EventState(SDL_SYSWMEVENT, SDL_IGNORE);
     SDL_EventState(SDL_USEREVENT, SDL_IGNORE);
 
+    display_mutex = SDL_CreateMutex();
+    display_cond = SDL_CreateCond();
+    scale_pool = scale_pool_alloc();
+    if (!display_mutex || !display_cond || !scale_pool)
+    {
+            av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex/SDL_CreateCond(): %s\n", SDL_GetError());
+            do_exit(NULL);
+    }
+
+    /* open and probe the input while the window and the renderer are created */
+    is = stream_open(input_filename, file_iformat);
+    if (!is)
+    {
+            av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
+            do_exit(NULL);
+    }
+    for (i = 1; i < nb_input_filenames; i++)
+    {
+            if (!stream_open(input_filenames[i], file_iformat))
+            {
+                    av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState for '%s'!\n", input_filenames[i]);
+                    do_exit(is);
+            }
+    }
+
     if (!display_disable)
     {
             int flags = SDL_WINDOW_HIDDEN;
@@ -1193,19 +7418,17 @@ int main(int argc, char *argv[])
             if (!window || !renderer || !renderer_info.num_texture_formats)
             {
             av_log(NULL, AV_LOG_FATAL, "Failed to create window or renderer: %s", SDL_GetError());
-            do_exit(NULL);
+            do_exit(is);
             }
+            startup_mark("window and renderer created");
 
     }
+    set_display_ready();
 
-    is = stream_open(input_filename, file_iformat);
-    if (!is)
-    {
-            av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
-            do_exit(NULL);
-    }
-
-    event_loop(is);
+    if (bench)
+            bench_loop(is);
+    else
+            event_loop(is);
 
     return 0;
 }